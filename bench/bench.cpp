@@ -0,0 +1,460 @@
+// Parse, lookup, recursive find, prefab flattening and write timings on a generated or given items_game
+//
+//   kv_bench [items_game.txt] [corpus options] [--iterations N] [--json]
+//
+// Every phase runs iterations times and reports the fastest run, allocations are counted on the last run
+// Peak RSS is the process peak after the phase so it only grows, compare it between runs with the same corpus
+// Before timing it checks that parse, parse_parallel and parse_lazy build the same tree and fails if they don't
+
+#include "../csgo.hpp"
+#include "corpus.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <new>
+#include <unordered_set>
+
+#ifdef _WIN32
+    #include <psapi.h>
+#else
+    #include <sys/resource.h>
+#endif
+
+namespace
+{
+    std::atomic<u64> g_allocations{ 0 };
+    std::atomic<u64> g_allocated{ 0 };
+
+    // Called through a volatile pointer so GCC doesn't pair the inlined replacements up and
+    // warn about memory from operator new going to free ( -Wmismatched-new-delete )
+    void ( *volatile g_free )( void* ) = std::free;
+}
+
+// Counts every allocation made through new, the aligned forms too since std::pmr's default resource uses them
+void* operator new( std::size_t size )
+{
+    g_allocations.fetch_add( 1, std::memory_order_relaxed );
+    g_allocated.fetch_add( size, std::memory_order_relaxed );
+
+    if ( void* ptr = std::malloc( size ? size : 1 ) )
+        return ptr;
+
+    throw std::bad_alloc{ };
+}
+void* operator new( std::size_t size, std::align_val_t align )
+{
+    g_allocations.fetch_add( 1, std::memory_order_relaxed );
+    g_allocated.fetch_add( size, std::memory_order_relaxed );
+
+    usize alignment = static_cast< usize >( align );
+    size = ( std::max<usize>( size, 1 ) + alignment - 1 ) / alignment * alignment;
+
+#ifdef _WIN32
+    if ( void* ptr = _aligned_malloc( size, alignment ) )
+#else
+    if ( void* ptr = std::aligned_alloc( alignment, size ) )
+#endif
+        return ptr;
+
+    throw std::bad_alloc{ };
+}
+void* operator new[ ]( std::size_t size )
+{
+    return operator new( size );
+}
+void operator delete( void* ptr ) noexcept
+{
+    g_free( ptr );
+}
+void operator delete[ ]( void* ptr ) noexcept
+{
+    g_free( ptr );
+}
+void operator delete( void* ptr, std::size_t ) noexcept
+{
+    g_free( ptr );
+}
+void operator delete[ ]( void* ptr, std::size_t ) noexcept
+{
+    g_free( ptr );
+}
+void* operator new[ ]( std::size_t size, std::align_val_t align )
+{
+    return operator new( size, align );
+}
+void operator delete( void* ptr, std::align_val_t ) noexcept
+{
+#ifdef _WIN32
+    _aligned_free( ptr );
+#else
+    g_free( ptr );
+#endif
+}
+void operator delete[ ]( void* ptr, std::align_val_t align ) noexcept
+{
+    operator delete( ptr, align );
+}
+void operator delete( void* ptr, std::size_t, std::align_val_t align ) noexcept
+{
+    operator delete( ptr, align );
+}
+void operator delete[ ]( void* ptr, std::size_t, std::align_val_t align ) noexcept
+{
+    operator delete( ptr, align );
+}
+
+namespace valve::bench
+{
+    struct result_t
+    {
+        std::string_view m_name;
+        f64              m_seconds{ 0.0 };
+        u64              m_bytes{ 0 };          // Text read or written, 0 if it doesn't apply
+        u64              m_nodes{ 0 };          // Nodes created or looked up
+        u64              m_allocations{ 0 };
+        u64              m_allocated{ 0 };
+        u64              m_peak_rss{ 0 };
+    };
+
+    u64 peak_rss( )
+    {
+#ifdef _WIN32
+        PROCESS_MEMORY_COUNTERS counters{ };
+        GetProcessMemoryInfo( GetCurrentProcess( ), &counters, sizeof( counters ) );
+        return counters.PeakWorkingSetSize;
+#else
+        rusage usage{ };
+        getrusage( RUSAGE_SELF, &usage );
+    #ifdef __APPLE__
+        return usage.ru_maxrss;
+    #else
+        return static_cast< u64 >( usage.ru_maxrss ) * 1024;
+    #endif
+#endif
+    }
+
+    u64 count_nodes( key_value& kv )
+    {
+        u64 count = 1;
+
+        if ( kv.type( ) == key_value::value_type::BLOCK )
+        {
+            for ( auto& [k, v] : kv.map( ) )
+                count += count_nodes( v );
+        }
+
+        return count;
+    }
+
+    // Same keys, types and values, map order doesn't matter
+    bool same_tree( key_value& a, key_value& b )
+    {
+        if ( a.type( ) != b.type( ) )
+            return false;
+
+        if ( a.type( ) == key_value::value_type::VALUE )
+            return a.value( ).as_str_v( ) == b.value( ).as_str_v( );
+
+        if ( a.map( ).size( ) != b.map( ).size( ) )
+            return false;
+
+        for ( auto& [k, v] : a.map( ) )
+        {
+            key_value* other = b.find( k );
+
+            if ( !other || !same_tree( v, *other ) )
+                return false;
+        }
+
+        return true;
+    }
+
+    // parse_parallel and parse_lazy promise the same tree as parse, text that fails has to fail in all three
+    bool parsers_agree( std::string_view text )
+    {
+        kv_file serial{ std::string{ text } };
+        kv_file parallel{ std::string{ text } };
+        kv_file lazy{ std::string{ text } };
+
+        bool ok = serial.parse( );
+
+        if ( parallel.parse_parallel( 0, 2 ) != ok || lazy.parse_lazy( 2 ) != ok )
+            return false;
+
+        return !ok || ( same_tree( serial.root( ), parallel.root( ) ) && same_tree( serial.root( ), lazy.root( ) ) );
+    }
+
+    // Makes the compiler assume value is read so the work producing it can't be dropped
+    template <typename T>
+    void do_not_optimize( const T& value )
+    {
+#if defined( __GNUC__ ) || defined( __clang__ )
+        asm volatile( "" : : "r,m"( value ) : "memory" );
+#else
+        static const void* volatile sink;
+        sink = &value;
+#endif
+    }
+
+    // Best time of iterations runs of fn( input ) with a fresh input from setup( ) each run, only fn is timed
+    // Whatever fn returns is destroyed after the clock stops
+    template <typename S, typename F>
+    result_t measure( std::string_view name, u32 iterations, S&& setup, F&& fn )
+    {
+        result_t result{ name };
+        result.m_seconds = 1e30;
+
+        for ( u32 i = 0; i < iterations; ++i )
+        {
+            auto input = setup( );
+
+            u64 allocations = g_allocations.load( std::memory_order_relaxed );
+            u64 allocated = g_allocated.load( std::memory_order_relaxed );
+            auto start = std::chrono::steady_clock::now( );
+
+            auto output = fn( input );
+            do_not_optimize( output );
+
+            auto end = std::chrono::steady_clock::now( );
+            result.m_seconds = std::min( result.m_seconds, std::chrono::duration<f64>( end - start ).count( ) );
+            result.m_allocations = g_allocations.load( std::memory_order_relaxed ) - allocations;
+            result.m_allocated = g_allocated.load( std::memory_order_relaxed ) - allocated;
+        }
+
+        result.m_peak_rss = peak_rss( );
+        return result;
+    }
+    template <typename F>
+    result_t measure( std::string_view name, u32 iterations, F&& fn )
+    {
+        return measure( name, iterations, [ ]( ) { return 0; }, [ & ]( int ) { return fn( ); } );
+    }
+
+    void print_table( const std::vector<result_t>& results, usize text_size, u64 nodes )
+    {
+        fmt::print( "corpus {:.2f} MB, {} nodes\n\n", text_size / ( 1024.0 * 1024.0 ), nodes );
+        fmt::print( "{:<12} {:>10} {:>10} {:>12} {:>12} {:>12} {:>12}\n", "phase", "ms", "MB/s", "Mnodes/s", "allocs", "alloc MB", "peak RSS MB" );
+
+        for ( const result_t& r : results )
+        {
+            f64 mb = r.m_bytes / ( 1024.0 * 1024.0 );
+
+            fmt::print( "{:<12} {:>10.3f} {:>10} {:>12.2f} {:>12} {:>12.2f} {:>12.1f}\n",
+                r.m_name,
+                r.m_seconds * 1000.0,
+                r.m_bytes ? fmt::format( "{:.1f}", mb / r.m_seconds ) : std::string{ "-" },
+                r.m_nodes / r.m_seconds / 1e6,
+                r.m_allocations,
+                r.m_allocated / ( 1024.0 * 1024.0 ),
+                r.m_peak_rss / ( 1024.0 * 1024.0 ) );
+        }
+    }
+
+    // One object per run so results from different commits can be diffed or plotted
+    void print_json( const std::vector<result_t>& results, usize text_size, u64 nodes, std::string_view source, const corpus_options& options )
+    {
+        fmt::print( "{{\n  \"corpus\": {{ \"source\": \"{}\", \"bytes\": {}, \"nodes\": {}", source, text_size, nodes );
+
+        if ( source == "generated" )
+        {
+            fmt::print( ", \"depth\": {}, \"fan_out\": {}, \"key_mean\": {}, \"key_stddev\": {}, \"vocabulary\": {}, \"comments\": {}, \"seed\": {}",
+                options.m_depth, options.m_fan_out, options.m_key_mean, options.m_key_stddev, options.m_vocabulary, options.m_comment_density, options.m_seed );
+        }
+
+        fmt::print( " }},\n  \"phases\": [\n" );
+
+        for ( usize i = 0; i < results.size( ); ++i )
+        {
+            const result_t& r = results[ i ];
+
+            fmt::print( "    {{ \"name\": \"{}\", \"seconds\": {:.6f}, \"mb_per_s\": {:.3f}, \"nodes_per_s\": {:.0f}, \"allocations\": {}, \"allocated_bytes\": {}, \"peak_rss_bytes\": {} }}{}\n",
+                r.m_name,
+                r.m_seconds,
+                r.m_bytes / ( 1024.0 * 1024.0 ) / r.m_seconds,
+                r.m_nodes / r.m_seconds,
+                r.m_allocations,
+                r.m_allocated,
+                r.m_peak_rss,
+                i + 1 < results.size( ) ? "," : "" );
+        }
+
+        fmt::print( "  ]\n}}\n" );
+    }
+}
+
+int main( int argc, char** argv )
+{
+    using namespace valve;
+    using namespace valve::bench;
+
+    corpus_options options;
+    std::string_view file;
+    u32 iterations = 5;
+    bool json = false;
+
+    for ( int i = 1; i < argc; ++i )
+    {
+        std::string_view arg = argv[ i ];
+
+        if ( arg == "--json" )
+            json = true;
+        else if ( arg == "--iterations" && i + 1 < argc )
+            iterations = std::max( std::atoi( argv[ ++i ] ), 1 );
+        else if ( arg.substr( 0, 2 ) == "--" && i + 1 < argc && options.set( arg, argv[ i + 1 ] ) )
+            ++i;
+        else if ( arg.substr( 0, 2 ) != "--" && file.empty( ) )
+            file = arg;
+        else
+        {
+            fmt::print( stderr, "usage: kv_bench [items_game.txt] [options]\n{}  --iterations N     runs per phase ( 5 )\n  --json             print json\n", corpus_options::usage );
+            return EXIT_FAILURE;
+        }
+    }
+
+    std::string text;
+
+    if ( !file.empty( ) )
+    {
+        std::ifstream in( std::string{ file }, std::ios::binary );
+
+        if ( !in.good( ) )
+        {
+            fmt::print( stderr, "can't open {}\n", file );
+            return EXIT_FAILURE;
+        }
+
+        text.resize( fs::file_size( file ) );
+        in.read( text.data( ), text.size( ) );
+    }
+    else
+        text = corpus_generator{ options }.generate( );
+
+    std::optional<kv_file> kvf = kv_file::from_string( text );
+    key_value* items = kvf ? kvf->find_block( "items_game" ) : nullptr;
+    items = items ? items->find_block( "items" ) : nullptr;
+
+    if ( !items )
+    {
+        fmt::print( stderr, "corpus has no items_game/items block\n" );
+        return EXIT_FAILURE;
+    }
+
+    u64 nodes = count_nodes( kvf->root( ) );
+
+    // Braces and quotes after a value on the same line are thrown away, the block scan has to agree
+    if ( !parsers_agree( text ) || !parsers_agree( "\"root\" { \"a\" { \"x\" \"1\" }\n\"y\" \"2\" } \"b\" \"3\" }\n" ) )
+    {
+        fmt::print( stderr, "parse, parse_parallel and parse_lazy disagree\n" );
+        return EXIT_FAILURE;
+    }
+
+    // Keys used inside items, looked up in every item so some hit and some miss
+    std::vector<std::string_view> probes{ "name", "prefab", "item_name" };
+    std::unordered_set<std::string_view> seen{ probes.begin( ), probes.end( ) };
+
+    for ( auto& [k, item] : items->map( ) )
+    {
+        if ( item.type( ) != key_value::value_type::BLOCK )
+            continue;
+
+        for ( auto& [child_key, child] : item.map( ) )
+        {
+            if ( probes.size( ) < 64 && seen.insert( child_key.m_key ).second )
+                probes.push_back( child_key.m_key );
+        }
+    }
+
+    std::vector<result_t> results;
+
+    result_t parse = measure( "parse", iterations, [ & ]( )
+    {
+        return kv_file::from_string( text );
+    } );
+    parse.m_bytes = text.size( );
+    parse.m_nodes = nodes;
+    results.push_back( parse );
+
+    u64 lookups = 0;
+    result_t lookup = measure( "lookup", iterations, [ & ]( )
+    {
+        u64 hits = 0;
+        lookups = 0;
+
+        for ( auto& [k, item] : items->map( ) )
+        {
+            for ( std::string_view probe : probes )
+            {
+                key_value* result = item.find( probe );
+                do_not_optimize( result );
+                hits += result != nullptr;
+                ++lookups;
+            }
+        }
+
+        return hits;
+    } );
+    lookup.m_nodes = lookups;
+    results.push_back( lookup );
+
+    u64 searches = 0;
+    result_t recursive = measure( "recursive", iterations, [ & ]( )
+    {
+        u64 hits = 0;
+        usize probe = 0;
+        searches = 0;
+
+        for ( auto& [k, item] : items->map( ) )
+        {
+            key_value* result = item.find_recursive( probes[ probe++ % probes.size( ) ] );
+            do_not_optimize( result );
+            hits += result != nullptr;
+            ++searches;
+        }
+
+        return hits;
+    } );
+    recursive.m_nodes = searches;
+    results.push_back( recursive );
+
+    // items_game parses and then flattens
+    result_t items_game = measure( "items_game", iterations, [ & ]( )
+    {
+        return csgo::items_game::from_string( text );
+    } );
+    items_game.m_bytes = text.size( );
+    items_game.m_nodes = nodes;
+    results.push_back( items_game );
+
+    // Flatten alone, the file is parsed before the clock starts
+    result_t flatten = measure( "flatten", iterations, [ & ]( )
+    {
+        return kv_file::from_string( text );
+    }, [ & ]( std::optional<kv_file>& parsed )
+    {
+        csgo::items_game ig;
+        ig.load( std::move( *parsed ) );
+        return ig;
+    } );
+    flatten.m_nodes = nodes;
+    results.push_back( flatten );
+
+    usize written = 0;
+    result_t write = measure( "write", iterations, [ & ]( )
+    {
+        std::string out;
+        kvf->write( out );
+        written = out.size( );
+        return out;
+    } );
+    write.m_bytes = written;
+    write.m_nodes = nodes;
+    results.push_back( write );
+
+    if ( json )
+        print_json( results, text.size( ), nodes, file.empty( ) ? std::string_view{ "generated" } : file, options );
+    else
+        print_table( results, text.size( ), nodes );
+
+    return EXIT_SUCCESS;
+}
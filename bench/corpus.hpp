@@ -0,0 +1,275 @@
+#pragma once
+
+#include "../types.hpp"
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <charconv>
+
+#include <fmt/format.h>
+
+namespace valve::bench
+{
+    // Shape of the generated items_game, the same options and seed always give the same text
+    struct corpus_options
+    {
+        usize m_size{ 16 * 1024 * 1024 };   // Approximate size in bytes
+        u32   m_depth{ 3 };                 // Block nesting inside each item, prefab and paint kit
+        u32   m_fan_out{ 8 };               // Children per block
+        u32   m_key_mean{ 12 };             // Key length distribution, roughly normal
+        u32   m_key_stddev{ 6 };
+        u32   m_vocabulary{ 512 };          // Distinct keys blocks pick from
+        f32   m_comment_density{ 0.05f };   // Chance of a comment after a line
+        u32   m_seed{ 1 };
+
+        // Applies --name value, false if name isn't a corpus option or value doesn't parse
+        bool set( std::string_view name, std::string_view value )
+        {
+            auto number = [ & ]( auto& out ) -> bool
+            {
+                auto [ptr, ec] = std::from_chars( value.data( ), value.data( ) + value.size( ), out );
+                return ec == std::errc{ } && ptr == value.data( ) + value.size( );
+            };
+
+            if ( name == "--size" )
+            {
+                f64 mb;
+                if ( !number( mb ) || mb <= 0.0 )
+                    return false;
+
+                m_size = static_cast< usize >( mb * 1024.0 * 1024.0 );
+                return true;
+            }
+
+            if ( name == "--depth" )
+                return number( m_depth );
+            if ( name == "--fan-out" )
+                return number( m_fan_out ) && m_fan_out > 0;
+            if ( name == "--key-mean" )
+                return number( m_key_mean ) && m_key_mean > 0;
+            if ( name == "--key-stddev" )
+                return number( m_key_stddev );
+            if ( name == "--vocabulary" )
+                return number( m_vocabulary ) && m_vocabulary > 1;
+            if ( name == "--comments" )
+                return number( m_comment_density );
+            if ( name == "--seed" )
+                return number( m_seed );
+
+            return false;
+        }
+
+        static constexpr const char* usage =
+            "  --size MB          approximate corpus size ( 16 )\n"
+            "  --depth N          block nesting inside items ( 3 )\n"
+            "  --fan-out N        children per block ( 8 )\n"
+            "  --key-mean N       mean key length ( 12 )\n"
+            "  --key-stddev N     key length deviation ( 6 )\n"
+            "  --vocabulary N     distinct keys ( 512 )\n"
+            "  --comments F       chance of a comment after a line ( 0.05 )\n"
+            "  --seed N           generator seed ( 1 )\n";
+    };
+
+    // items_game shaped text: prefabs that inherit from each other, items using them and paint kits
+    // Only uses std::mt19937 output directly so the corpus is the same with every standard library
+    class corpus_generator
+    {
+    public:
+        corpus_generator( const corpus_options& options ) :
+            m_options{ options },
+            m_random{ options.m_seed }
+        {
+            make_vocabulary( );
+        }
+
+        std::string generate( )
+        {
+            m_out.clear( );
+            m_out.reserve( m_options.m_size + 64 * 1024 );
+
+            line( 0, "\"items_game\"", false );
+            line( 0, "{" );
+
+            section( 1, "rarities", 0, m_options.m_size / 1000, [ & ]( u32 i )
+            {
+                value( 3, "value", fmt::format( "{}", i ) );
+                value( 3, "loc_key_weapon", fmt::format( "Rarity_{}", i ) );
+                value( 3, "color", fmt::format( "color_{}", i ) );
+            } );
+
+            section( 1, "prefabs", 0, m_options.m_size / 10, [ & ]( u32 i )
+            {
+                // Most prefabs inherit so items walk chains like the real file
+                if ( i > 0 && chance( 0.7f ) )
+                {
+                    // Separate statements, argument order isn't fixed and would change the corpus between compilers
+                    std::string_view valve = chance( 0.1f ) ? "valve " : "";
+                    value( 3, "prefab", fmt::format( "{}prefab_{}", valve, uniform( i ) ) );
+                }
+
+                body( 3, m_options.m_depth );
+            }, "prefab_" );
+            m_prefabs = m_last_count;
+
+            section( 1, "items", 1, m_options.m_size * 7 / 10, [ & ]( u32 i )
+            {
+                value( 3, "name", fmt::format( "item_{}", i ) );
+                value( 3, "prefab", fmt::format( "prefab_{}", uniform( std::max( m_prefabs, 1u ) ) ) );
+                value( 3, "item_name", fmt::format( "#Item_Name_{}", i ) );
+                body( 3, m_options.m_depth );
+            } );
+
+            section( 1, "paint_kits", 0, m_options.m_size * 2 / 10, [ & ]( u32 i )
+            {
+                value( 3, "name", fmt::format( "paint_{}", i ) );
+                value( 3, "description_tag", fmt::format( "#PaintKit_{}_Tag", i ) );
+                value( 3, "wear_remap_min", fmt::format( "{:.2f}", uniform( 50 ) / 100.f ) );
+                value( 3, "wear_remap_max", fmt::format( "{:.2f}", 0.5f + uniform( 50 ) / 100.f ) );
+                body( 3, m_options.m_depth > 0 ? m_options.m_depth - 1 : 0 );
+            } );
+
+            line( 0, "}" );
+            return std::move( m_out );
+        }
+
+    private:
+        // Blocks named prefix + index until the section is budget bytes long, at least one
+        template <typename F>
+        void section( u32 indent, std::string_view name, u32 first, usize budget, F&& entry, std::string_view prefix = {} )
+        {
+            usize start = m_out.size( );
+            u32 count = 0;
+
+            block_begin( indent, name );
+
+            do
+            {
+                block_begin( indent + 1, fmt::format( "{}{}", prefix, first + count ) );
+                entry( first + count );
+                block_end( indent + 1 );
+                ++count;
+            } while ( m_out.size( ) - start < budget );
+
+            block_end( indent );
+            m_last_count = count;
+        }
+
+        // fan_out children, some of them blocks while depth is left
+        void body( u32 indent, u32 depth )
+        {
+            for ( u32 i = 0; i < m_options.m_fan_out; ++i )
+            {
+                if ( depth > 0 && chance( 0.25f ) )
+                {
+                    const std::string& key = m_block_keys[ uniform( static_cast< u32 >( m_block_keys.size( ) ) ) ];
+                    block_begin( indent, key );
+                    body( indent + 1, depth - 1 );
+                    block_end( indent );
+                    continue;
+                }
+
+                const std::string& key = m_value_keys[ uniform( static_cast< u32 >( m_value_keys.size( ) ) ) ];
+
+                switch ( uniform( 4 ) )
+                {
+                case 0:
+                    value( indent, key, fmt::format( "{}", uniform( 100000 ) ) );
+                    break;
+                case 1:
+                    value( indent, key, fmt::format( "{:.3f}", uniform( 100000 ) / 1000.f ) );
+                    break;
+                case 2:
+                    value( indent, key, fmt::format( "#{}_{}", key, uniform( 1000 ) ) );
+                    break;
+                default:
+                    value( indent, key, fmt::format( "models/weapons/{}/{}.mdl", key, uniform( 1000 ) ) );
+                    break;
+                }
+            }
+        }
+
+        void block_begin( u32 indent, std::string_view key )
+        {
+            line( indent, fmt::format( "\"{}\"", key ), false );
+            line( indent, "{" );
+        }
+        void block_end( u32 indent )
+        {
+            line( indent, "}" );
+        }
+        void value( u32 indent, std::string_view key, std::string_view value )
+        {
+            line( indent, fmt::format( "\"{}\"\t\t\"{}\"", key, value ) );
+        }
+        // The parser doesn't take a comment between a block's key and its '{' so those go on the line before
+        void line( u32 indent, std::string_view text, bool trailing_comment = true )
+        {
+            bool comment = m_options.m_comment_density > 0.f && chance( m_options.m_comment_density );
+
+            if ( comment && !trailing_comment )
+            {
+                m_out.append( indent, '\t' );
+                m_out += "// generated comment\n";
+            }
+
+            m_out.append( indent, '\t' );
+            m_out += text;
+
+            if ( comment && trailing_comment )
+                m_out += "\t// generated comment";
+
+            m_out += '\n';
+        }
+
+        void make_vocabulary( )
+        {
+            static constexpr char charset[ ] = "abcdefghijklmnopqrstuvwxyz_0123456789";
+
+            m_block_keys.clear( );
+            m_value_keys.clear( );
+
+            for ( u32 i = 0; i < m_options.m_vocabulary; ++i )
+            {
+                // Sum of four uniforms is close enough to normal and doesn't depend on the standard library
+                f32 sum = 0.f;
+                for ( u32 j = 0; j < 4; ++j )
+                    sum += uniform( 1000 ) / 1000.f;
+
+                f32 length = m_options.m_key_mean + ( sum - 2.f ) * m_options.m_key_stddev * 1.7320508f;
+                usize size = static_cast< usize >( std::max( length, 1.f ) );
+
+                // Index suffix keeps keys distinct
+                std::string key = fmt::format( "{}", i );
+                while ( key.size( ) < size )
+                    key.insert( key.begin( ), charset[ uniform( 26 ) ] );
+
+                if ( key[ 0 ] >= '0' && key[ 0 ] <= '9' )
+                    key.insert( key.begin( ), 'k' );
+
+                // A key is always a block or always a value like in the real file, flattening prefabs relies on it
+                ( i % 4 == 0 ? m_block_keys : m_value_keys ).push_back( std::move( key ) );
+            }
+        }
+
+        u32 uniform( u32 count )
+        {
+            return static_cast< u32 >( m_random( ) % count );
+        }
+        bool chance( f32 p )
+        {
+            return uniform( 1u << 20 ) < static_cast< u32 >( p * ( 1u << 20 ) );
+        }
+
+    private:
+        corpus_options           m_options;
+        std::mt19937             m_random;
+        std::vector<std::string> m_block_keys;
+        std::vector<std::string> m_value_keys;
+        std::string              m_out;
+        u32                      m_prefabs{ 0 };
+        u32                      m_last_count{ 0 };
+    };
+}
@@ -0,0 +1,50 @@
+// Writes a generated items_game for kv_bench or other tools
+//
+//   kv_gen_corpus out.txt [corpus options]
+
+#include "corpus.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+
+int main( int argc, char** argv )
+{
+    using namespace valve::bench;
+
+    corpus_options options;
+    const char* path = nullptr;
+
+    for ( int i = 1; i < argc; ++i )
+    {
+        std::string_view arg = argv[ i ];
+
+        if ( arg.substr( 0, 2 ) == "--" && i + 1 < argc && options.set( arg, argv[ i + 1 ] ) )
+            ++i;
+        else if ( arg.substr( 0, 2 ) != "--" && !path )
+            path = argv[ i ];
+        else
+        {
+            fmt::print( stderr, "usage: kv_gen_corpus out.txt [options]\n{}", corpus_options::usage );
+            return EXIT_FAILURE;
+        }
+    }
+
+    if ( !path )
+    {
+        fmt::print( stderr, "usage: kv_gen_corpus out.txt [options]\n{}", corpus_options::usage );
+        return EXIT_FAILURE;
+    }
+
+    std::string text = corpus_generator{ options }.generate( );
+    std::ofstream out( path, std::ios::binary );
+
+    if ( !out.write( text.data( ), text.size( ) ) )
+    {
+        fmt::print( stderr, "can't write {}\n", path );
+        return EXIT_FAILURE;
+    }
+
+    fmt::print( "{} bytes\n", text.size( ) );
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "types.hpp"
+
+#include <array>
+#include <cstring>
+
+namespace valve
+{
+    // Slicing by 8 tables for the reflected IEEE polynomial, table k advances a byte through k more zero bytes
+    constexpr std::array<std::array<u32, 256>, 8> make_crc32_tables( )
+    {
+        std::array<std::array<u32, 256>, 8> tables{ };
+
+        for ( u32 i = 0; i < 256; ++i )
+        {
+            u32 crc = i;
+
+            for ( u32 bit = 0; bit < 8; ++bit )
+                crc = ( crc >> 1 ) ^ ( 0xedb88320u & ( 0u - ( crc & 1 ) ) );
+
+            tables[ 0 ][ i ] = crc;
+        }
+
+        for ( u32 i = 0; i < 256; ++i )
+        {
+            for ( u32 k = 1; k < 8; ++k )
+                tables[ k ][ i ] = ( tables[ k - 1 ][ i ] >> 8 ) ^ tables[ 0 ][ tables[ k - 1 ][ i ] & 0xff ];
+        }
+
+        return tables;
+    }
+
+    // CRC-32 as used by zip, zlib and vpk, pass the previous result as crc to continue over more data
+    inline u32 crc32( const u8* data, usize size, u32 crc = 0 )
+    {
+        static constexpr std::array<std::array<u32, 256>, 8> t = make_crc32_tables( );
+        crc = ~crc;
+
+        // 8 bytes per step, the little endian load matches the reflected polynomial
+        while ( size >= 8 )
+        {
+            u32 lo, hi;
+            std::memcpy( &lo, data, 4 );
+            std::memcpy( &hi, data + 4, 4 );
+
+#if defined( __BYTE_ORDER__ ) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+            lo = __builtin_bswap32( lo );
+            hi = __builtin_bswap32( hi );
+#endif
+            lo ^= crc;
+
+            crc = t[ 7 ][ lo & 0xff ] ^ t[ 6 ][ ( lo >> 8 ) & 0xff ] ^ t[ 5 ][ ( lo >> 16 ) & 0xff ] ^ t[ 4 ][ lo >> 24 ] ^
+                  t[ 3 ][ hi & 0xff ] ^ t[ 2 ][ ( hi >> 8 ) & 0xff ] ^ t[ 1 ][ ( hi >> 16 ) & 0xff ] ^ t[ 0 ][ hi >> 24 ];
+
+            data += 8;
+            size -= 8;
+        }
+
+        while ( size-- )
+            crc = ( crc >> 8 ) ^ t[ 0 ][ ( crc ^ *data++ ) & 0xff ];
+
+        return ~crc;
+    }
+}
@@ -10,8 +10,26 @@ namespace csgo
     class text_file
     {
     public:
-        bool load( const fs::path& file )
+        // Buffer and utf16 conversion allocate from resource
+        text_file( std::pmr::memory_resource* resource = kv_stats::default_resource( ) ) :
+            m_buffer{ resource }
+        {}
+
+        // With load_mode::map the file is used in place until converted
+        bool load( const fs::path& file, load_mode mode = load_mode::read )
         {
+            kv_stats::timer_t timer{ kv_stats::load };
+            m_file_ptr = 0;
+
+            if ( mode == load_mode::map && m_mapping.open( file ) )
+            {
+                m_buffer.clear( );
+                m_buffer.shrink_to_fit( );
+                return true;
+            }
+
+            m_mapping.close( );
+
             std::ifstream in( file, std::ios::binary );
 
             if ( !in.good( ) )
@@ -23,25 +41,42 @@ namespace csgo
         }
         void load( std::string_view str )
         {
+            kv_stats::timer_t timer{ kv_stats::load };
+            m_file_ptr = 0;
+            m_mapping.close( );
             m_buffer.resize( str.size( ) );
             std::memcpy( m_buffer.data( ), str.data( ), str.size( ) );
         }
 
-        u8* bytes( )
+        const u8* bytes( )
         {
-            return reinterpret_cast< u8* >( m_buffer.data( ) );
+            return reinterpret_cast< const u8* >( as_str_v( ).data( ) );
         }
         usize size( )
         {
-            return m_buffer.size( );
+            return as_str_v( ).size( );
         }
-        std::string& str( )
+        // Copies the mapping into the owned buffer if the file is mapped
+        std::pmr::string& str( )
         {
+            if ( m_mapping.is_open( ) )
+            {
+                m_buffer.assign( m_mapping.as_str_v( ) );
+                m_mapping.close( );
+            }
             return m_buffer;
         }
         std::string_view as_str_v( )
         {
-            return std::string_view{ m_buffer.data( ), m_buffer.size( ) };
+            return m_mapping.is_open( ) ? m_mapping.as_str_v( ) : std::string_view{ m_buffer.data( ), m_buffer.size( ) };
+        }
+        bool is_mapped( )
+        {
+            return m_mapping.is_open( );
+        }
+        mapped_file& mapping( )
+        {
+            return m_mapping;
         }
 
         // Reset to start
@@ -52,34 +87,38 @@ namespace csgo
         // Reads line by line when end of file returns empty string
         std::string_view read_line( )
         {
+            std::string_view buffer = as_str_v( );
+
             u32 start = m_file_ptr;
-            while ( m_file_ptr < m_buffer.size( ) && m_buffer[ m_file_ptr ] != '\n' )
+            while ( m_file_ptr < buffer.size( ) && buffer[ m_file_ptr ] != '\n' )
                 ++m_file_ptr;
 
             if ( start == m_file_ptr )
                 return std::string_view{};
 
             // dont include '\r\n' or '\n' in the line
-            u32 skip_size = m_buffer[ m_file_ptr - 1 ] == '\r' ? 2 : 1;
+            u32 skip_size = buffer[ m_file_ptr - 1 ] == '\r' ? 2 : 1;
 
             ++m_file_ptr; // skip '\n'
-            return std::string_view{ reinterpret_cast< char* >( &m_buffer[ start ] ), ( m_file_ptr - start ) - skip_size };
+            return std::string_view{ &buffer[ start ], ( m_file_ptr - start ) - skip_size };
         }
 
         bool utf16_le_bom( )
         {
-            return m_buffer.size( ) >= 2 && *reinterpret_cast< u16* >( m_buffer.data( ) ) == 0xFEFF; // UTF-16 LE BOM
+            return size( ) >= 2 && *reinterpret_cast< const u16* >( bytes( ) ) == 0xFEFF; // UTF-16 LE BOM
         }
         void convert_utf16_to_utf8( )
         {
+            kv_stats::timer_t timer{ kv_stats::load };
             u32 skip_amount = utf16_le_bom( ) ? 2 : 0;
-            m_buffer = convert_utf32_to_utf8( convert_utf16_to_utf32( std::u16string_view{ ( char16_t* )( m_buffer.data( ) + skip_amount ), ( m_buffer.size( ) - skip_amount ) / 2 } ) );
+            m_buffer = convert_utf32_to_utf8( convert_utf16_to_utf32( std::u16string_view{ ( const char16_t* )( bytes( ) + skip_amount ), ( size( ) - skip_amount ) / 2 } ) );
+            m_mapping.close( );
         }
 
     private:
-        std::string	convert_utf32_to_utf8( std::u32string_view utf32 )
+        std::pmr::string convert_utf32_to_utf8( std::u32string_view utf32 )
         {
-            std::string utf8;
+            std::pmr::string utf8{ m_buffer.get_allocator( ) };
             utf8.reserve( utf32.size( ) );
 
             for ( uint32_t i = 0; i < utf32.size( ); i++ )
@@ -119,9 +158,9 @@ namespace csgo
 
             return utf8;
         }
-        std::u32string convert_utf16_to_utf32( std::u16string_view utf16 )
+        std::pmr::u32string convert_utf16_to_utf32( std::u16string_view utf16 )
         {
-            std::u32string utf32;
+            std::pmr::u32string utf32{ m_buffer.get_allocator( ).resource( ) };
             utf32.reserve( utf16.size( ) );
 
             char16_t high_surrogate = 0;
@@ -152,25 +191,32 @@ namespace csgo
         }
 
     private:
-        u32             m_file_ptr{ 0 };
-        std::string     m_buffer;
+        u32              m_file_ptr{ 0 };
+        std::pmr::string m_buffer;
+        mapped_file      m_mapping;
     };
 
     class language
     {
     public:
-        static std::optional<language> from_file( const fs::path& file )
+        // The file, its text and the utf16 conversion allocate from resource
+        language( std::pmr::memory_resource* resource = kv_stats::default_resource( ) ) :
+            m_kv_file{ resource }
+        {}
+
+        static std::optional<language> from_file( const fs::path& file, load_mode mode = load_mode::read,
+            std::pmr::memory_resource* resource = kv_stats::default_resource( ) )
         {
-            language lang;
+            language lang{ resource };
 
-            if ( !lang.load( file ) )
+            if ( !lang.load( file, mode ) )
                 return std::nullopt;
 
             return lang;
         }
-        static std::optional<language> from_string( std::string_view str )
+        static std::optional<language> from_string( std::string_view str, std::pmr::memory_resource* resource = kv_stats::default_resource( ) )
         {
-            language lang;
+            language lang{ resource };
 
             if ( !lang.load( str ) )
                 return std::nullopt;
@@ -178,13 +224,13 @@ namespace csgo
             return lang;
         }
 
-        bool load( const fs::path& file )
+        bool load( const fs::path& file, load_mode mode = load_mode::read )
         {
-            return load_impl( file );
+            return load_impl( file, mode );
         }
         bool load( std::string_view str )
         {
-            return load_impl( str );
+            return load_impl( str, load_mode::read );
         }
 
         bool is_empty( )
@@ -215,13 +261,13 @@ namespace csgo
     private:
         // TODO: kinda ugly
         template <typename T>
-        bool load_impl( T file_or_str )
+        bool load_impl( T file_or_str, load_mode mode )
         {
-            text_file lang_txt;
+            text_file lang_txt{ m_kv_file.resource( ) };
             
             if constexpr ( std::is_same_v<T, std::filesystem::path> )
             {
-                if ( !lang_txt.load( file_or_str ) )
+                if ( !lang_txt.load( file_or_str, mode ) )
                     return false;
             }
             else
@@ -233,7 +279,11 @@ namespace csgo
             if ( lang_txt.utf16_le_bom( ) )
                 lang_txt.convert_utf16_to_utf8( );
 
-            m_kv_file = kv_file{ std::move( lang_txt.str( ) ) };
+            // Parse utf8 files in place when mapped
+            if ( lang_txt.is_mapped( ) && lang_txt.mapping( ).null_terminated( ) )
+                m_kv_file = kv_file{ std::move( lang_txt.mapping( ) ), m_kv_file.resource( ) };
+            else
+                m_kv_file = kv_file{ std::move( lang_txt.str( ) ) };
 
             if ( !m_kv_file.parse( ) )
                 return false;
@@ -255,11 +305,13 @@ namespace csgo
     };
 
 #pragma region MACROS
+// Keys are hashed at compile time
 // Returns key's value as string
 #define CSGO_STRING(name, key)                                              \
             std::string_view name()                                         \
             {                                                               \
-                if ( key_value* result = m_block->find( #key ); result )    \
+                static constexpr kv_key k{ #key };                          \
+                if ( key_value* result = m_block->find( k ); result )       \
                     return result->value( ).as_str_v( );                    \
                                                                             \
                 return std::string_view{};                                  \
@@ -269,7 +321,8 @@ namespace csgo
             std::string_view name( language* lang, language* fallback_lang = nullptr )      \
             {                                                                               \
                 key_value* result = nullptr;                                                \
-                if ( result = m_block->find( #key ); !result )                              \
+                static constexpr kv_key k{ #key };                                          \
+                if ( result = m_block->find( k ); !result )                                 \
                     return std::string_view{};                                              \
                                                                                             \
                 std::string_view token_result = lang->get_token( result->value( ) );        \
@@ -289,8 +342,9 @@ namespace csgo
 #define CSGO_INT(name, key)                                                 \
             i32 name()                                                      \
             {                                                               \
-                if ( key_value* result = m_block->find( #key ); result )    \
-                    return result->value( ).as_int( ).value();              \
+                static constexpr kv_key k{ #key };                          \
+                if ( key_value* result = m_block->find( k ); result )       \
+                    return result->as_int( ).value();                       \
                                                                             \
                 return 0;                                                   \
             }
@@ -298,8 +352,9 @@ namespace csgo
 #define CSGO_FLOAT(name, key)                                               \
             f32 name()                                                      \
             {                                                               \
-                if ( key_value* result = m_block->find( #key ); result )    \
-                    return result->value( ).as_float( ).value();            \
+                static constexpr kv_key k{ #key };                          \
+                if ( key_value* result = m_block->find( k ); result )       \
+                    return result->as_float( ).value();                     \
                                                                             \
                 return 0.f;                                                 \
             }
@@ -307,8 +362,9 @@ namespace csgo
 #define CSGO_INT_OPT(name, key)                                             \
             std::optional<i32> name()                                       \
             {                                                               \
-                if ( key_value* result = m_block->find( #key ); result )    \
-                    return result->value( ).as_int( );                      \
+                static constexpr kv_key k{ #key };                          \
+                if ( key_value* result = m_block->find( k ); result )       \
+                    return result->as_int( );                               \
                                                                             \
                 return std::nullopt;                                        \
             }
@@ -316,8 +372,9 @@ namespace csgo
 #define CSGO_FLOAT_OPT(name, key)                                           \
             std::optional<f32> name()                                       \
             {                                                               \
-                if ( key_value* result = m_block->find( #key ); result )    \
-                    return result->value( ).as_float( );                    \
+                static constexpr kv_key k{ #key };                          \
+                if ( key_value* result = m_block->find( k ); result )       \
+                    return result->as_float( );                             \
                                                                             \
                 return std::nullopt;                                        \
             }
@@ -474,18 +531,24 @@ namespace csgo
     class items_game
     {
     public:
-        static std::optional<items_game> from_file( const fs::path& file )
+        // The whole tree and its text allocate from resource
+        items_game( std::pmr::memory_resource* resource = kv_stats::default_resource( ) ) :
+            m_kv_file{ resource }
+        {}
+
+        static std::optional<items_game> from_file( const fs::path& file, load_mode mode = load_mode::read,
+            std::pmr::memory_resource* resource = kv_stats::default_resource( ) )
         {
-            items_game ig;
+            items_game ig{ resource };
 
-            if ( !ig.load( file ) )
+            if ( !ig.load( file, mode ) )
                 return std::nullopt;
 
             return ig;
         }
-        static std::optional<items_game> from_string( std::string_view str )
+        static std::optional<items_game> from_string( std::string_view str, std::pmr::memory_resource* resource = kv_stats::default_resource( ) )
         {
-            items_game ig;
+            items_game ig{ resource };
 
             if ( !ig.load( str ) )
                 return std::nullopt;
@@ -493,31 +556,25 @@ namespace csgo
             return ig;
         }
 
-        bool load( const fs::path& file )
+        bool load( const fs::path& file, load_mode mode = load_mode::read )
         {
-            if ( !m_kv_file.load( file ) )
-                return false;
-
-            m_block = m_kv_file.find_block( "items_game" );
-
-            if ( !m_block )
+            if ( !m_kv_file.load( file, mode ) )
                 return false;
 
-            flatten_item_prefabs( );
-            return true;
+            return init( );
         }
         bool load( std::string_view str )
         {
             if ( !m_kv_file.load( str ) )
                 return false;
 
-            m_block = m_kv_file.find_block( "items_game" );
-
-            if ( !m_block )
-                return false;
-
-            flatten_item_prefabs( );
-            return true;
+            return init( );
+        }
+        // Takes over a file that is already parsed, a file with another resource than this one has its tree copied
+        bool load( kv_file&& file )
+        {
+            m_kv_file = std::move( file );
+            return init( );
         }
 
         bool is_empty( )
@@ -556,9 +613,23 @@ namespace csgo
         }
 
     private:
+        bool init( )
+        {
+            m_block = m_kv_file.find_block( "items_game" );
+
+            if ( !m_block )
+                return false;
+
+            flatten_item_prefabs( );
+            return true;
+        }
         void flatten_item_prefabs( )
         {
-            key_value temp_kv{ "temp_kv" };
+            kv_stats::timer_t timer{ kv_stats::flatten };
+
+            // Same resource as the items, swapping maps with different resources isn't allowed
+            key_value temp_kv{ "temp_kv", m_kv_file.resource( ) };
+            kv_recursive_index index;
             key_value* prefabs = m_block->find( "prefabs" );
 
             auto fix_prefab_value = []( std::string_view value ) -> std::string_view
@@ -578,21 +649,25 @@ namespace csgo
                     temp_kv.map( ).clear( );
                     temp_kv.map( ).insert( block->map( ).begin( ), block->map( ).end( ) );
 
+                    // Prefab keys are looked up in everything merged so far
+                    index.build( temp_kv );
+
                     for ( key_value* prefab_block = prefabs->find_block( fix_prefab_value( prefab_value->value( ) ) );
                         prefab_block;
                         prefab_block = prefabs->find_block( fix_prefab_value( prefab_block->find_value( "prefab" )->value( ) ) ) )
                     {
                         for ( auto& [k, v] : prefab_block->map( ) )
                         {
-                            key_value* result = temp_kv.find_recursive( k );
+                            key_value* result = index.find( k );
 
                             if ( result && result->type( ) == key_value::value_type::BLOCK )
                             {
-                                result->map( ).insert( v.map( ).begin( ), v.map( ).end( ) );
+                                for ( auto& [child_key, child] : v.map( ) )
+                                    index.insert( *result, child_key, child );
                                 continue;
                             }
 
-                            temp_kv.map( ).insert( std::make_pair( k, v ) );
+                            index.insert( temp_kv, k, v );
                         }
 
                         if ( !prefab_block->find_value( "prefab" ) )
@@ -1,9 +1,13 @@
 #pragma once
 
 #include "types.hpp"
+#include "mapped_file.hpp"
+#include "parallel.hpp"
+#include "kv_stats.hpp"
 
 #include <string>
 #include <string_view>
+#include <cstring>
 #include <charconv>
 #include <variant>
 #include <optional>
@@ -11,11 +15,36 @@
 #include <stack>
 #include <fstream>
 #include <filesystem>
+#include <memory>
+#include <memory_resource>
+#include <vector>
+#include <functional>
+#include <ostream>
+#include <climits>
+#include <atomic>
+#include <mutex>
+
+#ifdef _WIN32
+    #include <io.h>
+#endif
 
 // define KV_PRINT_ERRORS for error printing
 #include <fmt/format.h>
 #include <fmt/ostream.h>
 
+// define KV_NO_SIMD to force the scalar scanner (e.g. for address sanitizer builds)
+#if !defined( KV_NO_SIMD ) && defined( __AVX2__ )
+    #define KV_SIMD_AVX2
+    #include <immintrin.h>
+#elif !defined( KV_NO_SIMD ) && ( defined( __SSE2__ ) || defined( _M_X64 ) || ( defined( _M_IX86_FP ) && _M_IX86_FP >= 2 ) )
+    #define KV_SIMD_SSE2
+    #include <emmintrin.h>
+#endif
+
+#if defined( _MSC_VER ) && ( defined( KV_SIMD_AVX2 ) || defined( KV_SIMD_SSE2 ) )
+    #include <intrin.h>
+#endif
+
 namespace valve
 {
     namespace fs = std::filesystem;
@@ -90,61 +119,309 @@ namespace valve
         std::string_view m_value;
     };
 
-    class key_value
+    // Key with its case insensitive hash computed once, constexpr so fixed keys are hashed at compile time
+    // Keys interned by kv_file share their text so equal keys usually compare by pointer
+    struct kv_key
     {
-        friend class kv_file;
+        constexpr kv_key( ) = default;
+        constexpr kv_key( std::string_view key ) : m_key{ key }, m_hash{ hash( key ) } {}
+        constexpr kv_key( const char* key ) : kv_key{ std::string_view{ key } } {}
+        kv_key( const std::string& key ) : kv_key{ std::string_view{ key } } {}
+        constexpr kv_key( std::string_view key, u32 hash ) : m_key{ key }, m_hash{ hash } {}
+
+        operator std::string_view( ) const
+        {
+            return m_key;
+        }
+
+        // ASCII only like tolower in the C locale but usable at compile time
+        static constexpr char lower( char c )
+        {
+            return c >= 'A' && c <= 'Z' ? static_cast< char >( c + ( 'a' - 'A' ) ) : c;
+        }
+
+        // FNV-1a 32bit hash
+        static constexpr u32 hash( std::string_view s )
+        {
+            u32 hash = 0x811c9dc5;
+
+            for ( usize i = 0; i < s.size( ); i++ )
+            {
+                hash ^= static_cast< u8 >( lower( s[ i ] ) );
+                hash *= 0x01000193;
+            }
+
+            return hash;
+        }
+        static constexpr bool equal( std::string_view a, std::string_view b )
+        {
+            if ( a.size( ) != b.size( ) )
+                return false;
+
+            for ( usize i = 0; i < a.size( ); i++ )
+            {
+                if ( lower( a[ i ] ) != lower( b[ i ] ) )
+                    return false;
+            }
+
+            return true;
+        }
+
+        bool operator==( const kv_key& other ) const
+        {
+            if ( m_hash != other.m_hash || m_key.size( ) != other.m_key.size( ) )
+                return false;
+
+            return m_key.data( ) == other.m_key.data( ) || equal( m_key, other.m_key );
+        }
+
+        std::string_view m_key;
+        u32              m_hash{ hash( std::string_view{} ) };
+    };
+
+    // Every distinct key text once, nodes with the same key share one kv_key
+    class kv_intern_table
+    {
+    public:
+        kv_intern_table( std::pmr::memory_resource* resource = kv_stats::default_resource( ) ) :
+            m_slots{ resource }
+        {}
 
-        struct case_insensitive_hash
+        // Returns existing key with the exact same text or adds this one
+        kv_key intern( std::string_view key )
         {
-            // FNV-1a 32bit hash
-            std::size_t operator()( const std::string_view s ) const
+            // Keep load factor under 0.5
+            if ( ( m_count + 1 ) * 2 > m_slots.size( ) )
+                grow( );
+
+            u32 hash = kv_key::hash( key );
+            usize mask = m_slots.size( ) - 1;
+
+            for ( usize i = hash & mask;; i = ( i + 1 ) & mask )
             {
-                size_t hash = 0x811c9dc5;
+                kv_key& slot = m_slots[ i ];
 
-                for ( i32 i = 0; i < s.size( ); i++ )
+                if ( slot.m_key.data( ) == nullptr )
                 {
-                    char c = s[ i ];
-                    hash ^= tolower( c );
-                    hash *= 0x01000193;
+                    slot = kv_key{ key, hash };
+                    ++m_count;
+                    return slot;
                 }
 
-                return hash;
+                if ( slot.m_hash == hash && slot.m_key == key )
+                    return slot;
+            }
+        }
+        // Existing key with the same text or a new handle that isn't interned
+        kv_key find( std::string_view key ) const
+        {
+            u32 hash = kv_key::hash( key );
+
+            if ( m_slots.empty( ) )
+                return kv_key{ key, hash };
+
+            usize mask = m_slots.size( ) - 1;
+
+            for ( usize i = hash & mask; m_slots[ i ].m_key.data( ); i = ( i + 1 ) & mask )
+            {
+                if ( m_slots[ i ].m_hash == hash && m_slots[ i ].m_key == key )
+                    return m_slots[ i ];
+            }
+
+            return kv_key{ key, hash };
+        }
+
+        usize size( ) const
+        {
+            return m_count;
+        }
+        void clear( )
+        {
+            m_slots.clear( );
+            m_count = 0;
+        }
+
+    private:
+        void grow( )
+        {
+            std::pmr::vector<kv_key> old = std::move( m_slots );
+            m_slots.assign( old.empty( ) ? 256 : old.size( ) * 2, kv_key{ std::string_view{}, 0 } );
+
+            usize mask = m_slots.size( ) - 1;
+
+            for ( const kv_key& key : old )
+            {
+                if ( !key.m_key.data( ) )
+                    continue;
+
+                usize i = key.m_hash & mask;
+                while ( m_slots[ i ].m_key.data( ) )
+                    i = ( i + 1 ) & mask;
+
+                m_slots[ i ] = key;
             }
+        }
+
+    private:
+        std::pmr::vector<kv_key> m_slots;
+        usize                    m_count{ 0 };
+    };
+
+    class key_value
+    {
+        friend class kv_file;
+        friend class kv_flat_file;
+        friend class kv_recursive_index;
+
+        struct key_hash
+        {
+            std::size_t operator()( const kv_key& key ) const
+            {
+                return key.m_hash;
+            }
+        };
+
+        // Block that hasn't been parsed yet, bodies start after the '{' and there is one per duplicate block
+        struct lazy_t
+        {
+            std::pmr::vector<std::pair<const char*, u32>> m_bodies;
+            std::pmr::memory_resource*                    m_resource;     // for the map once it's parsed
+            const char*                                   m_text;         // start of the document, for node positions
+        };
+
+        // Whether m_var still holds a lazy_t, read before touching m_var so first use of a lazy block
+        // from several threads parses it once
+        enum load_state : u8
+        {
+            loaded,
+            lazy,
+            failed      // Deferred body had a syntax error, the block was left empty
         };
-        struct case_insensitive_equal
+
+        // Value text and its numeric conversions, each conversion runs once
+        // Fits in the space the variant already has for the map so values don't get bigger
+        // Atomic since const looking reads fill them, a result is stored before its flags are set
+        struct value_data_t
         {
-            bool operator()( const std::string_view a, const std::string_view b ) const
+            enum : u8
             {
-                if ( a.size( ) != b.size( ) )
-                    return false;
+                int_done    = 1 << 0,
+                int_ok      = 1 << 1,
+                float_done  = 1 << 2,
+                float_ok    = 1 << 3,
+                hex_done    = 1 << 4,
+                hex_ok      = 1 << 5
+            };
 
-                for ( i32 i = 0; i < a.size( ); i++ )
-                {
-                    if ( tolower( a[ i ] ) != tolower( b[ i ] ) )
-                        return false;
-                }
+            value_data_t( std::string_view text ) : m_text{ text } {}
+            value_data_t( const value_data_t& other ) : m_text{ other.m_text }
+            {
+                copy( other );
+            }
+            // Moves copy too, atomics can't be moved, noexcept so map and vector reallocation moves
+            value_data_t( value_data_t&& other ) noexcept : m_text{ other.m_text }
+            {
+                copy( other );
+            }
+            value_data_t& operator=( const value_data_t& other )
+            {
+                m_text = other.m_text;
+                copy( other );
+                return *this;
+            }
+            value_data_t& operator=( value_data_t&& other ) noexcept
+            {
+                m_text = other.m_text;
+                copy( other );
+                return *this;
+            }
 
-                return true;
+            void copy( const value_data_t& other ) noexcept
+            {
+                u8 flags = other.m_flags.load( std::memory_order_acquire );
+                m_int.store( other.m_int.load( std::memory_order_relaxed ), std::memory_order_relaxed );
+                m_hex.store( other.m_hex.load( std::memory_order_relaxed ), std::memory_order_relaxed );
+                m_float.store( other.m_float.load( std::memory_order_relaxed ), std::memory_order_relaxed );
+                m_flags.store( flags, std::memory_order_release );
             }
+
+            std::string_view m_text;
+            std::atomic<i32> m_int{ 0 };
+            std::atomic<i32> m_hex{ 0 };
+            std::atomic<f32> m_float{ 0.f };
+            std::atomic<u8>  m_flags{ 0 };
         };
 
     public:
-        enum class value_type { VALUE, BLOCK };
-        using kv_map_t = std::unordered_map<std::string_view, key_value, case_insensitive_hash, case_insensitive_equal>;
-        using var_t = std::variant<std::string_view, kv_map_t>;
+        enum class value_type : u8 { VALUE, BLOCK };
+        // Position of nodes that weren't parsed from text
+        static constexpr u32 no_position = ~0u;
+        using kv_map_t = std::pmr::unordered_map<kv_key, key_value, key_hash>;
+        using var_t = std::variant<value_data_t, kv_map_t, lazy_t>;
 
         // Construct value
-        key_value( std::string_view key, std::string_view value ) :
+        key_value( kv_key key, std::string_view value ) :
             m_type{ value_type::VALUE },
             m_key{ key },
-            m_var{ value }
+            m_var{ value_data_t{ value } }
         {}
-        // Construct block
-        key_value( std::string_view key ) :
+        // Construct block, its map allocates from resource
+        key_value( kv_key key, std::pmr::memory_resource* resource = kv_stats::default_resource( ) ) :
             m_type{ value_type::BLOCK },
             m_key{ key },
-            m_var{ kv_map_t{} }
+            m_var{ std::in_place_type<kv_map_t>, resource }
+        {}
+        // Copies keep the resource of the block they were copied from
+        key_value( const key_value& other ) :
+            m_type{ other.m_type },
+            m_position{ other.m_position },
+            m_key{ other.m_key },
+            m_var{ copy_var( other ) }
+#ifdef KV_STATS
+            , m_lookups{ other.m_lookups }
+#endif
         {}
+        key_value( key_value&& other ) noexcept :
+            m_type{ other.m_type },
+            m_state{ other.m_state.load( std::memory_order_relaxed ) },
+            m_position{ other.m_position },
+            m_key{ other.m_key },
+            m_var{ std::move( other.m_var ) }
+#ifdef KV_STATS
+            , m_lookups{ other.m_lookups }
+#endif
+        {}
+        key_value& operator=( const key_value& other )
+        {
+            if ( this != &other )
+            {
+                m_type = other.m_type;
+                m_position = other.m_position;
+                m_key = other.m_key;
+                m_var = copy_var( other );
+#ifdef KV_STATS
+                m_lookups = other.m_lookups;
+#endif
+            }
+
+            return *this;
+        }
+        key_value& operator=( key_value&& other ) noexcept
+        {
+            if ( this != &other )
+            {
+                m_type = other.m_type;
+                m_state.store( other.m_state.load( std::memory_order_relaxed ), std::memory_order_relaxed );
+                m_position = other.m_position;
+                m_key = other.m_key;
+                m_var = std::move( other.m_var );
+#ifdef KV_STATS
+                m_lookups = other.m_lookups;
+#endif
+            }
+
+            return *this;
+        }
 
         value_type type( )
         {
@@ -152,18 +429,60 @@ namespace valve
         }
         value_t key( )
         {
-            return value_t{ m_key };
+            return value_t{ m_key.m_key };
         }
         value_t value( )
         {
-            return value_t{ std::get<std::string_view>( m_var ) };
+            return value_t{ std::get<value_data_t>( m_var ).m_text };
+        }
+
+        // value( ).as_int( ) and friends converted on first use and cached in the node
+        // Safe to call from several threads, two threads converting the same value at once both store the same result
+        std::optional<i32> as_int( )
+        {
+            value_data_t& data = std::get<value_data_t>( m_var );
+            return cached( data, data.m_int, value_data_t::int_done, value_data_t::int_ok, [ & ]( ) { return value_t{ data.m_text }.as_int( ); } );
         }
-        kv_map_t& map( )
+        std::optional<f32> as_float( )
         {
-            return std::get<kv_map_t>( m_var );
+            value_data_t& data = std::get<value_data_t>( m_var );
+            return cached( data, data.m_float, value_data_t::float_done, value_data_t::float_ok, [ & ]( ) { return value_t{ data.m_text }.as_float( ); } );
+        }
+        std::optional<i32> as_hex_int( )
+        {
+            value_data_t& data = std::get<value_data_t>( m_var );
+            return cached( data, data.m_hex, value_data_t::hex_done, value_data_t::hex_ok, [ & ]( ) { return value_t{ data.m_text }.as_hex_int( ); } );
+        }
+        // Converts every value below this block up front so later reads only load the cached results
+        void cache_numbers( )
+        {
+            if ( m_type == value_type::VALUE )
+            {
+                as_int( );
+                as_float( );
+                as_hex_int( );
+                return;
+            }
+
+            for ( auto& [k, v] : map( ) )
+                v.cache_numbers( );
+        }
+        // Parses the block first if it was left for later by kv_file::parse_lazy
+        // Safe to call from several threads, the first one parses and the others wait for it
+        kv_map_t& map( );
+        // False for blocks from kv_file::parse_lazy that nothing has looked into yet
+        bool is_loaded( ) const
+        {
+            return m_state.load( std::memory_order_acquire ) != lazy;
+        }
+        // True for a deferred block whose body didn't parse, map( ) is empty then
+        bool parse_failed( ) const
+        {
+            return m_state.load( std::memory_order_acquire ) == failed;
         }
 
-        key_value* find( std::string_view key )
+        // Pass a kv_key kept around ( or from kv_file::intern ) to skip hashing
+        key_value* find( const kv_key& key )
         {
             if ( m_type == value_type::VALUE )
                 return nullptr;
@@ -171,66 +490,301 @@ namespace valve
             auto& kv_map = map( );
 
             if ( auto result = kv_map.find( key ); result != kv_map.end( ) )
+            {
+                count_lookup( true );
                 return &result->second;
+            }
 
+            count_lookup( false );
             return nullptr;
         }
-        key_value* find_block( std::string_view key )
+        key_value* find_block( const kv_key& key )
         {
             if ( key_value* kv = find( key ); kv && kv->m_type == value_type::BLOCK )
                 return kv;
 
             return nullptr;
         }
-        key_value* find_value( std::string_view key )
+        key_value* find_value( const kv_key& key )
         {
             if ( key_value* kv = find( key ); kv && kv->m_type == value_type::VALUE )
                 return kv;
 
             return nullptr;
         }
-        key_value* find_recursive( std::string_view key )
+        // Searches every block below this one, the match closest to this block wins and between matches at the
+        // same depth the one whose key comes first in the text, so results don't depend on map order
+        // Nodes added after parsing come after parsed ones, copies keep the position of their source
+        // Use kv_recursive_index when searching the same tree many times
+        key_value* find_recursive( const kv_key& key )
         {
-            std::stack<kv_map_t*> map_stack;
-            map_stack.push( &map( ) );
+            if ( m_type != value_type::BLOCK )
+                return nullptr;
 
-            while ( !map_stack.empty( ) )
-            {
-                kv_map_t* map = map_stack.top( );
-                map_stack.pop( );
+            std::vector<key_value*> level{ this };
+            std::vector<key_value*> next;
 
-                if ( auto it = map->find( key ); it != map->end( ) )
-                    return &it->second;
+            while ( !level.empty( ) )
+            {
+                key_value* best = nullptr;
 
-                for ( auto& [k, v] : *map )
+                for ( key_value* block : level )
                 {
-                    if ( v.m_type != value_type::BLOCK )
-                        continue;
+                    if ( key_value* kv = block->find( key ); kv && ( !best || kv->comes_before( *best ) ) )
+                        best = kv;
 
-                    map_stack.push( &v.map( ) );
+                    for ( auto& [k, v] : block->map( ) )
+                    {
+                        if ( v.m_type == value_type::BLOCK )
+                            next.push_back( &v );
+                    }
                 }
+
+                if ( best )
+                    return best;
+
+                level.swap( next );
+                next.clear( );
             }
 
             return nullptr;
         }
+        // Order between matches at the same depth for find_recursive
+        bool comes_before( const key_value& other ) const
+        {
+            return m_position < other.m_position;
+        }
+        // Offset of the key in the text the node was parsed from, no_position for nodes added later
+        u32 position( ) const
+        {
+            return m_position;
+        }
 
         // Unsafe
-        key_value& operator[]( std::string_view key )
+        key_value& operator[]( const kv_key& key )
         {
             return *find( key );
         }
 
+        // Resource blocks below this one should allocate from
+        std::pmr::memory_resource* resource( ) const
+        {
+            std::unique_lock<std::mutex> lock;
+
+            if ( !is_loaded( ) )
+                lock = std::unique_lock<std::mutex>{ lazy_lock( ) };
+
+            if ( const kv_map_t* map = std::get_if<kv_map_t>( &m_var ) )
+                return map->get_allocator( ).resource( );
+
+            if ( const lazy_t* lazy = std::get_if<lazy_t>( &m_var ) )
+                return lazy->m_resource;
+
+            return kv_stats::default_resource( );
+        }
+
+    private:
+        void count_lookup( [[maybe_unused]] bool hit ) const
+        {
+#ifdef KV_STATS
+            kv_stats::lookup( hit, m_lookups );
+#endif
+        }
+
+        static var_t copy( const var_t& var )
+        {
+            if ( const kv_map_t* map = std::get_if<kv_map_t>( &var ) )
+                return var_t{ std::in_place_type<kv_map_t>, *map, map->get_allocator( ) };
+
+            return var;
+        }
+        // Also takes the state of other, which may be parsed by map( ) on another thread while it is copied
+        var_t copy_var( const key_value& other )
+        {
+            std::unique_lock<std::mutex> lock;
+
+            if ( !other.is_loaded( ) )
+                lock = std::unique_lock<std::mutex>{ other.lazy_lock( ) };
+
+            m_state.store( other.m_state.load( std::memory_order_relaxed ), std::memory_order_relaxed );
+            return copy( other.m_var );
+        }
+        // Serializes the first map( ) of a lazy block, picked by address so different blocks rarely share one
+        // Parsing a block never touches another lazy block so these are never nested
+        std::mutex& lazy_lock( ) const
+        {
+            static std::mutex locks[ 32 ];
+            return locks[ reinterpret_cast< std::uintptr_t >( this ) / sizeof( key_value ) % 32 ];
+        }
+        // Map of a block that is known to be parsed, kv_file::builder_t fills blocks without going through map( )
+        kv_map_t& parsed_map( )
+        {
+            return std::get<kv_map_t>( m_var );
+        }
+
+        // Runs convert the first time, the release on the flags publishes the stored result
+        template <typename T, typename F>
+        static std::optional<T> cached( value_data_t& data, std::atomic<T>& out, u8 done, u8 ok, F&& convert )
+        {
+            u8 flags = data.m_flags.load( std::memory_order_acquire );
+
+            if ( !( flags & done ) )
+            {
+                std::optional<T> result = convert( );
+
+                if ( result )
+                    out.store( *result, std::memory_order_relaxed );
+
+                u8 set = result ? done | ok : done;
+                flags = data.m_flags.fetch_or( set, std::memory_order_acq_rel ) | set;
+            }
+
+            return flags & ok ? std::optional<T>{ out.load( std::memory_order_relaxed ) } : std::nullopt;
+        }
+
     private:
         value_type       m_type;
-        std::string_view m_key;
+        std::atomic<u8>  m_state{ loaded };
+        u32              m_position{ no_position };
+        kv_key           m_key;
         var_t            m_var;
+#ifdef KV_STATS
+        // Counters of the kv_file the node was parsed into, copies and moves keep counting there
+        // which is fine since they point into the text of that file and can't outlive it either
+        kv_stats::lookup_counters_t* m_lookups{ nullptr };
+#endif
     };
 
-    class kv_file
+    // find_recursive for every key at once, maps each key to the node find_recursive would return
+    // Insert through the index to keep it up to date, after removing nodes call build again
+    class kv_recursive_index
+    {
+        struct entry_t
+        {
+            key_value* m_kv;
+            u32        m_depth;
+        };
+
+        struct key_hash
+        {
+            std::size_t operator()( const kv_key& key ) const
+            {
+                return key.m_hash;
+            }
+        };
+
+    public:
+        kv_recursive_index( ) = default;
+        kv_recursive_index( key_value& root )
+        {
+            build( root );
+        }
+
+        void build( key_value& root )
+        {
+            clear( );
+
+            if ( root.type( ) != key_value::value_type::BLOCK )
+                return;
+
+            m_depths[ &root ] = 0;
+
+            for ( auto& [k, v] : root.map( ) )
+                add( v, 0 );
+        }
+        void clear( )
+        {
+            m_first.clear( );
+            m_depths.clear( );
+        }
+
+        // Same result as root.find_recursive( key )
+        key_value* find( const kv_key& key ) const
+        {
+            if ( auto it = m_first.find( key ); it != m_first.end( ) )
+                return it->second.m_kv;
+
+            return nullptr;
+        }
+
+        // block.map( ).try_emplace( key, kv ) that also indexes the new subtree, block has to be in the indexed tree
+        // Returns the node under key, the existing one if the key was already there
+        key_value* insert( key_value& block, const kv_key& key, const key_value& kv )
+        {
+            auto [it, inserted] = block.map( ).try_emplace( key, kv );
+
+            if ( inserted )
+                add( it->second, m_depths.at( &block ) );
+
+            return &it->second;
+        }
+
+    private:
+        // Indexes kv and everything below it
+        void add( key_value& kv, u32 depth )
+        {
+            std::vector<entry_t> stack{ entry_t{ &kv, depth } };
+
+            while ( !stack.empty( ) )
+            {
+                entry_t entry = stack.back( );
+                stack.pop_back( );
+
+                auto [it, inserted] = m_first.try_emplace( entry.m_kv->m_key, entry );
+
+                if ( !inserted && ( entry.m_depth < it->second.m_depth ||
+                    ( entry.m_depth == it->second.m_depth && entry.m_kv->comes_before( *it->second.m_kv ) ) ) )
+                    it->second = entry;
+
+                if ( entry.m_kv->type( ) != key_value::value_type::BLOCK )
+                    continue;
+
+                m_depths[ entry.m_kv ] = entry.m_depth + 1;
+
+                for ( auto& [k, v] : entry.m_kv->map( ) )
+                    stack.push_back( entry_t{ &v, entry.m_depth + 1 } );
+            }
+        }
+
+    private:
+        std::unordered_map<kv_key, entry_t, key_hash> m_first;
+        // Depth of the children of every indexed block
+        std::unordered_map<const key_value*, u32>   m_depths;
+    };
+
+    // Returned from kv_reader visitor callbacks
+    enum class kv_action
+    {
+        next,   // Keep going, enters the block when returned from block_begin
+        skip,   // Skip the whole block without emitting events, only used by block_begin
+        stop    // Stop parsing
+    };
+
+    // Default visitor callbacks, derive from it and hide the ones you need
+    struct kv_visitor
+    {
+        kv_action value( std::string_view /*key*/, std::string_view /*value*/ )
+        {
+            return kv_action::next;
+        }
+        kv_action block_begin( std::string_view /*key*/ )
+        {
+            return kv_action::next;
+        }
+        kv_action block_end( )
+        {
+            return kv_action::next;
+        }
+    };
+
+    // Event parser, emits keys and values as string_views into the text without building a tree
+    // Text has to be null terminated
+    class kv_reader
     {
+    public:
         struct parser_t
         {
-            parser_t( const char* text ) : m_text{ text }, m_start{ text }, m_current{ text }, m_line{ 1 } {};
+            parser_t( const char* text, u32 line = 1 ) : m_text{ text }, m_start{ text }, m_current{ text }, m_line{ line } {};
 
             const char* m_text;
             const char* m_start;
@@ -248,12 +802,44 @@ namespace valve
             inline void skip_whitespace( )
             {
                 char c = *m_current;
-                while ( c == ' ' || c == '\r' || c == '\t' || c == '\n' )
+
+                // Most runs are a single space or nothing at all
+                if ( !is_whitespace( c ) )
+                    return;
+
+#if defined( KV_SIMD_AVX2 ) || defined( KV_SIMD_SSE2 )
+                m_current = scan_whitespace( m_current, m_line );
+#else
+                while ( is_whitespace( c ) )
                 {
                     if ( c == '\n' )
                         ++m_line;
                     c = *++m_current;
                 }
+#endif
+            }
+            // Move to the next quote, brace, slash or the end of the text counting new lines on the way
+            inline void skip_to_structural( )
+            {
+#if defined( KV_SIMD_AVX2 ) || defined( KV_SIMD_SSE2 )
+                m_current = scan_structural( m_current, m_line );
+#else
+                for ( char c = *m_current; c != '"' && c != '{' && c != '}' && c != '/' && c != '\0'; c = *++m_current )
+                {
+                    if ( c == '\n' )
+                        ++m_line;
+                }
+#endif
+            }
+            // Move to the next new line or the end of the text
+            inline void skip_line( )
+            {
+#if defined( KV_SIMD_AVX2 ) || defined( KV_SIMD_SSE2 )
+                m_current = scan_for( m_current, '\n' );
+#else
+                while ( peek( ) != '\n' && !is_end( ) )
+                    advance( );
+#endif
             }
             inline bool is_end( )
             {
@@ -280,25 +866,28 @@ namespace valve
                 return true;
             }
 
-            inline std::optional<std::string_view> string( )
+            // Moves past the string that starts at the current quote, false if the text ends first
+            inline bool string_end( )
             {
                 // consume starting quote
                 advance( );
 
-                //while ( !( prev( ) != '\\' && peek( ) == '"' ) && peek( ) != '\n' && !is_end( ) )
-                // valve kv file values span over to new lines so had to remove newline check
+                // valve kv file values span over to new lines so only a quote that isn't escaped ends the string
+#if defined( KV_SIMD_AVX2 ) || defined( KV_SIMD_SSE2 )
+                while ( m_current = scan_for( m_current, '"' ), !is_end( ) && prev( ) == '\\' )
+                    advance( );
+#else
                 while ( !( prev( ) != '\\' && peek( ) == '"' ) && !is_end( ) )
                     advance( );
+#endif
 
+                // consume closing quote
+                return match( '"' );
+            }
+            inline std::optional<std::string_view> string( )
+            {
                 // Unterminated string
-                if ( is_end( ) )
-                {
-                    fmt::print( "Unterminated string on line {}!\n", m_line );
-                    return std::nullopt;
-                }
-
-                // consume closing quote
-                if ( !match( '"' ) )
+                if ( !string_end( ) )
                 {
                     fmt::print( "Unterminated string on line {}!\n", m_line );
                     return std::nullopt;
@@ -322,65 +911,174 @@ namespace valve
 
                 return std::string_view{ start, length };
             }
-        };
 
-    public:
-        kv_file( ) = default;
-        // To be able to steal memory from csgo::language string
-        kv_file( std::string&& str ) : m_data{ std::move( str ) } {}
+        private:
+            static constexpr bool is_whitespace( char c )
+            {
+                return c == ' ' || c == '\r' || c == '\t' || c == '\n';
+            }
 
-        static std::optional<kv_file> from_file( const fs::path& file )
-        {
-            kv_file kvf;
+#if defined( KV_SIMD_AVX2 ) || defined( KV_SIMD_SSE2 )
+    #ifdef KV_SIMD_AVX2
+            using vec_t = __m256i;
+            static constexpr usize vec_size = 32;
+            static constexpr u32 vec_mask = ~0u;
+
+            static inline vec_t load( const char* ptr ) { return _mm256_load_si256( reinterpret_cast< const vec_t* >( ptr ) ); }
+            static inline vec_t splat( char c ) { return _mm256_set1_epi8( c ); }
+            static inline u32 eq_mask( vec_t a, vec_t b ) { return static_cast< u32 >( _mm256_movemask_epi8( _mm256_cmpeq_epi8( a, b ) ) ); }
+    #else
+            using vec_t = __m128i;
+            static constexpr usize vec_size = 16;
+            static constexpr u32 vec_mask = 0xFFFF;
+
+            static inline vec_t load( const char* ptr ) { return _mm_load_si128( reinterpret_cast< const vec_t* >( ptr ) ); }
+            static inline vec_t splat( char c ) { return _mm_set1_epi8( c ); }
+            static inline u32 eq_mask( vec_t a, vec_t b ) { return static_cast< u32 >( _mm_movemask_epi8( _mm_cmpeq_epi8( a, b ) ) ); }
+    #endif
+            static inline u32 ctz( u32 mask )
+            {
+    #ifdef _MSC_VER
+                unsigned long idx;
+                _BitScanForward( &idx, mask );
+                return idx;
+    #else
+                return __builtin_ctz( mask );
+    #endif
+            }
+            static inline u32 popcount( u32 mask )
+            {
+    #ifdef _MSC_VER
+                return __popcnt( mask );
+    #else
+                return __builtin_popcount( mask );
+    #endif
+            }
 
-            if ( !kvf.load( file ) || !kvf.parse( ) )
-                return std::nullopt;
+            // Loads are aligned so they never cross into an unmapped page past the terminating '\0',
+            // bytes in front of ptr are masked off
+            static inline const char* align_down( const char* ptr )
+            {
+                return reinterpret_cast< const char* >( reinterpret_cast< usize >( ptr ) & ~( vec_size - 1 ) );
+            }
 
-            return kvf;
-        }
-        static std::optional<kv_file> from_string( std::string_view str )
-        {
-            kv_file kvf;
-            kvf.load( str );
+            // Finds first c or '\0'
+            static inline const char* scan_for( const char* ptr, char c )
+            {
+                const vec_t needle = splat( c );
+                const vec_t zero = splat( '\0' );
 
-            if ( !kvf.parse( ) )
-                return std::nullopt;
+                const char* block = align_down( ptr );
+                vec_t chunk = load( block );
+                u32 mask = ( eq_mask( chunk, needle ) | eq_mask( chunk, zero ) ) & ( ~0u << ( ptr - block ) );
 
-            return kvf;
-        }
+                while ( !mask )
+                {
+                    block += vec_size;
+                    chunk = load( block );
+                    mask = eq_mask( chunk, needle ) | eq_mask( chunk, zero );
+                }
 
-        // Load and parse the file
-        bool load( const fs::path& file )
-        {
-            size_t size = fs::file_size( file );
+                return block + ctz( mask );
+            }
+            // Finds first non whitespace character and counts the new lines skipped on the way
+            static inline const char* scan_whitespace( const char* ptr, u32& line )
+            {
+                const vec_t space = splat( ' ' );
+                const vec_t tab = splat( '\t' );
+                const vec_t cr = splat( '\r' );
+                const vec_t lf = splat( '\n' );
 
-            std::ifstream in( file, std::ios::binary );
+                const char* block = align_down( ptr );
+                u32 valid = ( vec_mask << ( ptr - block ) ) & vec_mask;
 
-            if ( !in.good( ) )
-                return false;
+                while ( true )
+                {
+                    vec_t chunk = load( block );
+                    u32 newlines = eq_mask( chunk, lf );
+                    u32 whitespace = eq_mask( chunk, space ) | eq_mask( chunk, tab ) | eq_mask( chunk, cr ) | newlines;
+                    u32 stop = ~whitespace & valid;
 
-            m_data.resize( size );
-            in.read( m_data.data( ), size );
-            return parse( );
-        }
-        // Load and parse the file
-        bool load( std::string_view str )
+                    if ( stop )
+                    {
+                        // only count new lines in front of the stop character
+                        u32 first = ctz( stop );
+                        line += popcount( newlines & valid & ( ( 1u << first ) - 1 ) );
+                        return block + first;
+                    }
+
+                    line += popcount( newlines & valid );
+                    block += vec_size;
+                    valid = vec_mask;
+                }
+            }
+            // Finds first quote, brace, slash or '\0' and counts the new lines skipped on the way
+            static inline const char* scan_structural( const char* ptr, u32& line )
+            {
+                const vec_t quote = splat( '"' );
+                const vec_t open = splat( '{' );
+                const vec_t close = splat( '}' );
+                const vec_t slash = splat( '/' );
+                const vec_t zero = splat( '\0' );
+                const vec_t lf = splat( '\n' );
+
+                const char* block = align_down( ptr );
+                u32 valid = ( vec_mask << ( ptr - block ) ) & vec_mask;
+
+                while ( true )
+                {
+                    vec_t chunk = load( block );
+                    u32 newlines = eq_mask( chunk, lf );
+                    u32 stop = ( eq_mask( chunk, quote ) | eq_mask( chunk, open ) | eq_mask( chunk, close ) |
+                        eq_mask( chunk, slash ) | eq_mask( chunk, zero ) ) & valid;
+
+                    if ( stop )
+                    {
+                        u32 first = ctz( stop );
+                        line += popcount( newlines & valid & ( ( 1u << first ) - 1 ) );
+                        return block + first;
+                    }
+
+                    line += popcount( newlines & valid );
+                    block += vec_size;
+                    valid = vec_mask;
+                }
+            }
+#endif
+        };
+
+    public:
+        // line is the line text starts on when parsing from the middle of a document
+        kv_reader( const char* text, u32 line = 1 ) : m_parser{ text, line } {}
+
+        // Reader for the inside of a block, body starts after the '{' and parsing ends at the matching '}'
+        static kv_reader block_body( const char* body, u32 line )
         {
-            size_t size = str.size( );
-            m_data.resize( size );
-            std::memcpy( m_data.data( ), str.data( ), str.size( ) );
-            return parse( );
+            kv_reader reader{ body, line };
+            reader.m_in_block = true;
+            return reader;
         }
 
-        // Only call if you passed string in constructor load() calls parse already
-        bool parse( )
+        // Returns false on syntax error, stopping from a callback is not an error
+        // Parsing ends at the end of the text, a closing brace that has no block open is an error
+        // unless the reader was made with block_body, then it ends there
+        template <typename V>
+        bool parse( V& visitor )
         {
-            m_parser = parser_t{ m_data.c_str( ) };
-            m_root.map( ).clear( );
-
-            std::stack<key_value*> scope;
-            scope.push( &m_root );
+#ifdef KV_STATS
+            // Counts however parsing ends
+            struct stats_t
+            {
+                ~stats_t( )
+                {
+                    kv_stats::add( kv_stats::bytes_scanned, static_cast< u64 >( m_reader.m_parser.m_current - m_start ) );
+                    kv_stats::max( kv_stats::max_depth, m_reader.m_max_depth );
+                }
 
+                kv_reader&  m_reader;
+                const char* m_start;
+            } stats{ *this, m_parser.m_current };
+#endif // KV_STATS
 #ifdef KV_PRINT_ERRORS
             auto print_error_line = [ this ]( ) -> void
             {
@@ -423,12 +1121,10 @@ namespace valve
                         }
 
                         // Conditionals not supported [$PS3], [$XBOX360], [$WIN32] so skip them
-                        while ( m_parser.peek( ) != '\n' )
-                            m_parser.advance( );
+                        m_parser.skip_line( );
 
-                        key_value* parent = scope.top( );
-
-                        parent->map( ).try_emplace( *key, key_value{ *key, *value } );
+                        if ( visitor.value( *key, *value ) == kv_action::stop )
+                            return m_stopped = true;
                     }
 
                     // block
@@ -437,18 +1133,23 @@ namespace valve
                         // consume {
                         m_parser.advance( );
 
-                        key_value* parent = scope.top( );
-                        key_value::kv_map_t& map = parent->map( );
+                        kv_action action = visitor.block_begin( *key );
 
-                        // Find block if it already exists
-                        key_value* block = nullptr;
+                        if ( action == kv_action::stop )
+                            return m_stopped = true;
 
-                        if ( auto result = map.find( *key ); result != map.end( ) )
-                            block = &result->second;
+                        if ( action == kv_action::skip )
+                        {
+                            if ( !skip_block( ) )
+                                return false;
+                        }
                         else
-                            block = &parent->map( ).try_emplace( *key, key_value{ *key } ).first->second;
-
-                        scope.push( block );
+                        {
+                            ++m_depth;
+#ifdef KV_STATS
+                            m_max_depth = std::max( m_max_depth, m_depth );
+#endif
+                        }
                     }
 
                     continue;
@@ -457,17 +1158,27 @@ namespace valve
                 // Skip comments
                 else if ( c == '/' && m_parser.peek_next( ) == '/' )
                 {
-                    while ( m_parser.peek( ) != '\n' && !m_parser.is_end( ) )
-                        m_parser.advance( );
+                    m_parser.skip_line( );
                     continue;
                 }
 
                 // Block end
                 else if ( c == '}' )
                 {
-                    m_parser.advance( );
-                    scope.pop( );
-                    continue;
+                    // Closing brace of the block we started in
+                    if ( !m_depth && m_in_block )
+                        return true;
+
+                    if ( m_depth )
+                    {
+                        m_parser.advance( );
+                        --m_depth;
+
+                        if ( visitor.block_end( ) == kv_action::stop )
+                            return m_stopped = true;
+
+                        continue;
+                    }
                 }
 
                 // Error
@@ -475,10 +1186,752 @@ namespace valve
                 fmt::print( "Unexpected charachter\n" );
                 print_error_line( );
 #endif // KV_PRINT_ERRORS
+                return false;
+            }
+
+            return true;
+        }
+
+        // Skips the rest of the block that was just opened including the closing brace
+        // Only braces, strings and comments are looked at so it is much cheaper than parsing
+        bool skip_block( )
+        {
+            u32 depth = 1;
+
+            while ( true )
+            {
+                m_parser.skip_to_structural( );
+
+                switch ( m_parser.peek( ) )
+                {
+                case '\0':
+                    return true;
+                case '"':
+                    m_parser.reset_start( );
+                    if ( !m_parser.string( ) )
+                        return false;
+
+                    // Same as parse, the rest of the line after a value is thrown away
+                    m_parser.skip_whitespace( );
+                    if ( m_parser.peek( ) == '"' )
+                    {
+                        if ( !m_parser.string( ) )
+                            return false;
+
+                        m_parser.skip_line( );
+                    }
+                    break;
+                case '{':
+                    m_parser.advance( );
+                    ++depth;
+                    break;
+                case '}':
+                    m_parser.advance( );
+                    if ( !--depth )
+                        return true;
+                    break;
+                case '/':
+                    if ( m_parser.peek_next( ) == '/' )
+                        m_parser.skip_line( );
+                    else
+                        m_parser.advance( );
+                    break;
+                default:
+                    m_parser.advance( );
+                    break;
+                }
+            }
+        }
+
+        // Current line, for error reporting
+        u32 line( ) const
+        {
+            return m_parser.m_line;
+        }
+        // Blocks currently open
+        u32 depth( ) const
+        {
+            return m_depth;
+        }
+        // Parsing was stopped by the visitor
+        bool stopped( ) const
+        {
+            return m_stopped;
+        }
+        const char* position( ) const
+        {
+            return m_parser.m_current;
+        }
+
+    private:
+        parser_t m_parser;
+        u32      m_depth{ 0 };
+        bool     m_stopped{ false };
+        bool     m_in_block{ false };
+#ifdef KV_STATS
+        u32      m_max_depth{ 0 };
+#endif
+    };
+
+    // Stable storage for strings that don't live in the file text, views stay valid until the pool is cleared
+    class string_pool
+    {
+        static constexpr usize chunk_size = 16 * 1024;
+
+    public:
+        string_pool( std::pmr::memory_resource* resource = kv_stats::default_resource( ) ) :
+            m_chunks{ resource }
+        {}
+
+        std::string_view store( std::string_view str )
+        {
+            char* dst = allocate( str.size( ) );
+            std::memcpy( dst, str.data( ), str.size( ) );
+
+            return std::string_view{ dst, str.size( ) };
+        }
+        // Room for size charachters
+        char* allocate( usize size )
+        {
+            // Chunks never grow past their reserved size so pointers into them stay valid
+            if ( m_chunks.empty( ) || size > m_chunks.back( ).capacity( ) - m_chunks.back( ).size( ) )
+            {
+                m_chunks.emplace_back( );
+                m_chunks.back( ).reserve( std::max( chunk_size, size ) );
+            }
+
+            std::pmr::string& chunk = m_chunks.back( );
+            usize used = chunk.size( );
+            chunk.resize( used + size );
+
+            return chunk.data( ) + used;
+        }
+        void clear( )
+        {
+            m_chunks.clear( );
+        }
+
+    private:
+        std::pmr::vector<std::pmr::string> m_chunks;
+    };
+
+    // Output settings for kv_writer
+    struct kv_write_options
+    {
+        bool m_compact{ false };    // No indentation, values still end their line since the parser skips the rest of it
+        bool m_escape{ false };     // Escape every backslash and quote, for strings holding unescaped text like kv_binary values
+                                    // otherwise strings are written as parsed and only quotes that would end them early get escaped
+        u32  m_threads{ 1 };        // Write blocks at split_depth on this many threads, 0 means one per hardware thread
+        u32  m_split_depth{ 3 };    // Same depth as kv_file::parse_parallel
+    };
+
+    // Writes key_value trees in text format through one large buffer
+    // Output of a block's children parses back into the same tree
+    class kv_writer
+    {
+    public:
+        static constexpr usize buffer_size = 256 * 1024;
+
+        // Appends to out
+        kv_writer( std::string& out, kv_write_options options = {} ) : m_string{ &out }, m_options{ options } {}
+        kv_writer( std::ostream& out, kv_write_options options = {} ) : m_stream{ &out }, m_options{ options } {}
+        kv_writer( int fd, kv_write_options options = {} ) : m_fd{ fd }, m_options{ options } {}
+        ~kv_writer( )
+        {
+            flush( );
+        }
+
+        static bool write( key_value& block, const fs::path& path, kv_write_options options = {} )
+        {
+            std::ofstream out( path, std::ios::binary );
+
+            if ( !out.good( ) )
+                return false;
+
+            kv_writer writer{ out, options };
+            return writer.write( block ) && writer.flush( );
+        }
+
+        // Writes every child of block, false if writing to the stream or file descriptor failed
+        // or a string ends in a backslash, the reader takes the closing quote after it as escaped
+        bool write( key_value& block )
+        {
+            if ( block.type( ) != key_value::value_type::BLOCK )
+                return good( );
+
+            if ( thread_count( m_options.m_threads ) == 1 || m_options.m_split_depth == 0 )
+            {
+                write_block( buffer( ), block, 0 );
+                return good( );
+            }
+
+            // Everything above split depth goes into segments, blocks at split depth are written on their own
+            // and the output is segment 0, piece 0, segment 1, piece 1... segment n
+            std::vector<std::string> segments( 1 );
+            std::vector<std::pair<const kv_key*, key_value*>> pieces;
+            write_skeleton( segments, pieces, block, 0 );
+
+            std::vector<std::string> output( pieces.size( ) );
+
+            parallel_for( pieces.size( ), [ & ]( usize i )
+            {
+                write_node( output[ i ], *pieces[ i ].first, *pieces[ i ].second, m_options.m_split_depth - 1 );
+            }, m_options.m_threads );
+
+            for ( usize i = 0; i < pieces.size( ); ++i )
+            {
+                put( segments[ i ] );
+                put( output[ i ] );
+            }
+            put( segments.back( ) );
+
+            return good( );
+        }
+
+        // Writes out what is buffered
+        bool flush( )
+        {
+            if ( m_string || m_buffer.empty( ) )
+                return m_good;
+
+            put_direct( m_buffer );
+            m_buffer.clear( );
+            return m_good;
+        }
+
+    private:
+        bool good( ) const
+        {
+            return m_good && !m_unreadable.load( std::memory_order_relaxed );
+        }
+        std::string& buffer( )
+        {
+            return m_string ? *m_string : m_buffer;
+        }
+        void put( std::string_view str )
+        {
+            if ( m_string )
+            {
+                m_string->append( str );
+                return;
+            }
+
+            // Big pieces skip the buffer
+            if ( m_buffer.size( ) + str.size( ) > buffer_size )
+            {
+                flush( );
+
+                if ( str.size( ) >= buffer_size )
+                {
+                    put_direct( str );
+                    return;
+                }
+            }
+
+            m_buffer.append( str );
+        }
+        void put_direct( std::string_view str )
+        {
+            if ( m_stream )
+            {
+                m_stream->write( str.data( ), static_cast< std::streamsize >( str.size( ) ) );
+                m_good = m_good && m_stream->good( );
+                return;
+            }
+
+            while ( !str.empty( ) && m_good )
+            {
+#ifdef _WIN32
+                int written = _write( m_fd, str.data( ), static_cast< unsigned >( std::min<usize>( str.size( ), INT_MAX ) ) );
+#else
+                isize written = ::write( m_fd, str.data( ), str.size( ) );
+#endif
+                if ( written <= 0 )
+                    m_good = false;
+                else
+                    str.remove_prefix( static_cast< usize >( written ) );
+            }
+        }
+
+        void write_skeleton( std::vector<std::string>& segments, std::vector<std::pair<const kv_key*, key_value*>>& pieces, key_value& block, u32 depth )
+        {
+            for ( auto& [key, kv] : block.map( ) )
+            {
+                if ( kv.type( ) != key_value::value_type::BLOCK )
+                {
+                    write_node( segments.back( ), key, kv, depth );
+                    continue;
+                }
+
+                if ( depth + 1 == m_options.m_split_depth )
+                {
+                    pieces.emplace_back( &key, &kv );
+                    segments.emplace_back( );
+                    continue;
+                }
+
+                std::string& out = segments.back( );
+                open_block( out, key, depth );
+                write_skeleton( segments, pieces, kv, depth + 1 );
+                close_block( segments.back( ), depth );
+            }
+        }
+
+        void write_block( std::string& out, key_value& block, u32 depth )
+        {
+            for ( auto& [key, kv] : block.map( ) )
+                write_node( out, key, kv, depth );
+        }
+        void write_node( std::string& out, const kv_key& key, key_value& kv, u32 depth )
+        {
+            if ( kv.type( ) == key_value::value_type::VALUE )
+            {
+                indent( out, depth );
+                string( out, key.m_key );
+                if ( !m_options.m_compact )
+                    out += ' ';
+                string( out, kv.value( ).as_str_v( ) );
+                out += '\n';
+            }
+            else
+            {
+                open_block( out, key, depth );
+                write_block( out, kv, depth + 1 );
+                close_block( out, depth );
+            }
+
+            // Only the sequential buffer is flushed on the way, pieces are written whole
+            if ( &out == &m_buffer && m_buffer.size( ) >= buffer_size )
+                flush( );
+        }
+        void open_block( std::string& out, const kv_key& key, u32 depth )
+        {
+            indent( out, depth );
+            string( out, key.m_key );
+
+            if ( m_options.m_compact )
+                out += '{';
+            else
+            {
+                out += '\n';
+                indent( out, depth );
+                out += "{\n";
+            }
+        }
+        void close_block( std::string& out, u32 depth )
+        {
+            indent( out, depth );
+            out += m_options.m_compact ? "}" : "}\n";
+        }
+        void indent( std::string& out, u32 depth )
+        {
+            if ( !m_options.m_compact )
+                out.append( depth, '\t' );
+        }
+        void string( std::string& out, std::string_view str )
+        {
+            // Written anyway and reported by write( ), pieces get here on worker threads
+            if ( !str.empty( ) && str.back( ) == '\\' )
+                m_unreadable.store( true, std::memory_order_relaxed );
+
+            out += '"';
+
+            while ( !str.empty( ) )
+            {
+                usize pos = next_special( str );
+
+                if ( pos == str.size( ) )
+                    break;
+
+                out.append( str.data( ), pos );
+
+                // Parsed strings keep their escapes, a quote is only a problem if it isn't escaped already
+                if ( m_options.m_escape || pos == 0 || str[ pos - 1 ] != '\\' )
+                    out += '\\';
+
+                out += str[ pos ];
+                str.remove_prefix( pos + 1 );
+            }
+
+            out.append( str );
+            out += '"';
+        }
+        // Offset of the next charachter that may need escaping, str.size( ) if there is none
+        usize next_special( std::string_view str ) const
+        {
+            if ( !m_options.m_escape )
+            {
+                const void* quote = std::memchr( str.data( ), '"', str.size( ) );
+                return quote ? static_cast< usize >( static_cast< const char* >( quote ) - str.data( ) ) : str.size( );
+            }
+
+            usize pos = 0;
+            while ( pos < str.size( ) && str[ pos ] != '"' && str[ pos ] != '\\' )
+                ++pos;
+
+            return pos;
+        }
+
+    private:
+        std::string*      m_string{ nullptr };
+        std::ostream*     m_stream{ nullptr };
+        int               m_fd{ -1 };
+        kv_write_options  m_options;
+        std::string       m_buffer;
+        bool              m_good{ true };
+        std::atomic<bool> m_unreadable{ false };    // A string ended in a backslash
+    };
+
+    class kv_file
+    {
+        friend class kv_binary;
+        friend class key_value;
+
+        // Builds key_value tree from kv_reader events, text is the start of the document the keys point into
+        // Keys go through keys if it is set so repeated keys share one hashed kv_key
+        struct builder_t : kv_visitor
+        {
+            builder_t( key_value& root, const char* text, kv_intern_table* keys = nullptr ) :
+                m_scope{ std::pmr::vector<key_value*>{ root.parsed_map( ).get_allocator( ).resource( ) } },
+                m_text{ text },
+                m_keys{ keys }
+            {
+                m_scope.push( &root );
+            }
+
+            kv_action value( std::string_view key, std::string_view value )
+            {
+                kv_key k = make_key( key );
+                key_value kv{ k, value };
+                kv.m_position = position( key );
+                emplace( m_scope.top( )->parsed_map( ), k, std::move( kv ) );
+                return kv_action::next;
+            }
+            kv_action block_begin( std::string_view key )
+            {
+                key_value* block = open_block( make_key( key ), position( key ) );
+
+                if ( !block )
+                    return kv_action::skip;
+
+                m_scope.push( block );
+                return kv_action::next;
+            }
+            kv_action block_end( )
+            {
+                m_scope.pop( );
+                return kv_action::next;
+            }
+
+            // Finds block if it already exists, nullptr if the key is already used by a value since first one wins
+            // New blocks allocate from the same resource as their parent
+            key_value* open_block( const kv_key& key, u32 position )
+            {
+                key_value::kv_map_t& map = m_scope.top( )->parsed_map( );
+
+                auto result = map.find( key );
+
+                if ( result == map.end( ) )
+                {
+                    key_value block{ key, map.get_allocator( ).resource( ) };
+                    block.m_position = position;
+                    result = emplace( map, key, std::move( block ) ).first;
+#ifdef KV_STATS
+                    result->second.m_lookups = m_scope.top( )->m_lookups;
+#endif
+                }
+
+                if ( result->second.type( ) != key_value::value_type::BLOCK )
+                {
+                    kv_stats::add( kv_stats::duplicates_dropped );
+                    return nullptr;
+                }
+
+                return &result->second;
+            }
+            // try_emplace that counts new nodes, dropped duplicates and rehashes
+            static std::pair<key_value::kv_map_t::iterator, bool> emplace( key_value::kv_map_t& map, const kv_key& key, key_value&& kv )
+            {
+#ifdef KV_STATS
+                usize buckets = map.bucket_count( );
+                auto result = map.try_emplace( key, std::move( kv ) );
+
+                kv_stats::add( result.second ? kv_stats::nodes_created : kv_stats::duplicates_dropped );
+                kv_stats::add( kv_stats::rehashes, map.bucket_count( ) != buckets );
+                return result;
+#else
+                return map.try_emplace( key, std::move( kv ) );
+#endif
+            }
+
+            kv_key make_key( std::string_view key )
+            {
+                return m_keys ? m_keys->intern( key ) : kv_key{ key };
+            }
+            u32 position( std::string_view key ) const
+            {
+                return static_cast< u32 >( key.data( ) - m_text );
+            }
+
+            std::stack<key_value*, std::pmr::vector<key_value*>> m_scope;
+            const char*                                          m_text;
+            kv_intern_table*                                     m_keys;
+        };
+        // Builds the tree down to split depth and records blocks at that depth for parse_parallel
+        struct splitter_t : builder_t
+        {
+            struct task_t
+            {
+                key_value*  m_block;
+                const char* m_body;
+                u32         m_line;
+            };
+
+            splitter_t( key_value& root, const char* text, kv_reader& reader, u32 split_depth, kv_intern_table* keys ) :
+                builder_t{ root, text, keys },
+                m_reader{ reader },
+                m_split_depth{ split_depth }
+            {}
+
+            kv_action block_begin( std::string_view key )
+            {
+                if ( m_scope.size( ) != m_split_depth )
+                    return builder_t::block_begin( key );
+
+                if ( key_value* block = open_block( make_key( key ), position( key ) ); block )
+                    m_tasks.push_back( task_t{ block, m_reader.position( ), m_reader.line( ) } );
+
+                return kv_action::skip;
+            }
+
+            kv_reader&          m_reader;
+            u32                 m_split_depth;
+            std::vector<task_t> m_tasks;
+        };
+
+    public:
+        // Every node, map bucket and string the file owns is allocated from resource, the resource has to outlive the file
+        // A std::pmr::monotonic_buffer_resource per file makes parsing cost no global heap traffic and frees it all at once
+        // parse_parallel allocates from many threads and needs a thread safe resource like std::pmr::synchronized_pool_resource
+        kv_file( std::pmr::memory_resource* resource = kv_stats::default_resource( ) ) :
+            m_root{ "root", resource },
+            m_data{ resource },
+            m_pool{ resource },
+            m_keys{ resource }
+        {
+#ifdef KV_STATS
+            m_lookups = std::make_unique<kv_stats::lookup_counters_t>( );
+            m_root.m_lookups = m_lookups.get( );
+#endif
+        }
+        // To be able to steal memory from csgo::language string, the file uses the string's resource
+        kv_file( std::pmr::string&& str ) : kv_file{ str.get_allocator( ).resource( ) }
+        {
+            m_data = std::move( str );
+            keep_on_heap( m_data );
+        }
+        // Takes str over, the tree points into it
+        kv_file( std::string&& str ) : kv_file{ }
+        {
+            m_string = std::move( str );
+            keep_on_heap( m_string );
+        }
+        // Parse straight from a mapping, mapping has to be null terminated
+        kv_file( mapped_file&& mapping, std::pmr::memory_resource* resource = kv_stats::default_resource( ) ) :
+            kv_file{ resource }
+        {
+            m_mapping = std::move( mapping );
+        }
+
+        kv_file( kv_file&& ) = default;
+        // Containers with different resources copy instead of stealing on move assignment, which would leave
+        // the tree pointing into the old text, so then the tree is copied into this file's resource with every
+        // key and value stored in the pool, edits carry over and deferred blocks are parsed on the way
+        kv_file& operator=( kv_file&& other )
+        {
+            if ( this == &other )
+                return *this;
+
+            if ( resource( )->is_equal( *other.resource( ) ) )
+            {
+                m_root = std::move( other.m_root );
+                m_data = std::move( other.m_data );
+                m_string = std::move( other.m_string );
+                m_mapping = std::move( other.m_mapping );
+                m_pool = std::move( other.m_pool );
+                m_keys = std::move( other.m_keys );
+#ifdef KV_STATS
+                m_lookups = std::move( other.m_lookups );
+#endif
+                return *this;
+            }
+
+            m_root.map( ).clear( );
+            m_keys.clear( );
+            m_pool.clear( );
+            copy_tree( m_root, other.m_root );
+
+            // Nothing points into a text anymore
+            m_mapping.close( );
+            m_data.clear( );
+            m_data.shrink_to_fit( );
+            release_string( );
+            return *this;
+        }
+
+        static std::optional<kv_file> from_file( const fs::path& file, load_mode mode = load_mode::read,
+            std::pmr::memory_resource* resource = kv_stats::default_resource( ) )
+        {
+            kv_file kvf{ resource };
+
+            if ( !kvf.load( file, mode ) )
+                return std::nullopt;
+
+            return kvf;
+        }
+        static std::optional<kv_file> from_string( std::string_view str, std::pmr::memory_resource* resource = kv_stats::default_resource( ) )
+        {
+            kv_file kvf{ resource };
+
+            if ( !kvf.load( str ) )
+                return std::nullopt;
+
+            return kvf;
+        }
+
+        // Load and parse the file
+        // With load_mode::map values point into the mapping, falls back to reading if the file
+        // ends on a page boundary because there is no terminating '\0' to stop the parser
+        bool load( const fs::path& file, load_mode mode = load_mode::read )
+        {
+            if ( !read( file, mode ) )
+                return false;
+
+            return parse( );
+        }
+        // Load and parse the file
+        bool load( std::string_view str )
+        {
+            {
+                kv_stats::timer_t timer{ kv_stats::load };
+                m_mapping.close( );
+                release_string( );
+
+                size_t size = str.size( );
+                m_data.resize( size );
+                std::memcpy( m_data.data( ), str.data( ), str.size( ) );
+                keep_on_heap( m_data );
+            }
+
+            return parse( );
+        }
+
+        // Only call if you passed string in constructor load() calls parse already
+        bool parse( )
+        {
+            kv_stats::timer_t timer{ kv_stats::parse };
+
+            m_root.map( ).clear( );
+            m_keys.clear( );
+
+            builder_t builder{ m_root, text( ), &m_keys };
+            kv_reader reader{ text( ) };
+
+            if ( !reader.parse( builder ) )
+            {
+                m_root.map( ).clear( );
+                return false;
+            }
+
+            return true;
+        }
+
+        // Same result as parse( ) but blocks at lazy_depth are only found, not parsed, and get parsed the first
+        // time something looks into them through map( ), find... Depth 2 defers every items_game section
+        // Syntax errors inside deferred blocks aren't found here, such a block ends up empty with parse_failed( ) set
+        // Keys in deferred blocks aren't interned, moving the file would leave the blocks pointing at the old table
+        bool parse_lazy( u32 lazy_depth = 2 )
+        {
+            kv_stats::timer_t timer{ kv_stats::parse };
+
+            m_root.map( ).clear( );
+            m_keys.clear( );
+
+            kv_reader reader{ text( ) };
+            splitter_t splitter{ m_root, text( ), reader, lazy_depth, &m_keys };
+
+            if ( !reader.parse( splitter ) )
+            {
+                m_root.map( ).clear( );
+                return false;
+            }
+
+            for ( auto& task : splitter.m_tasks )
+            {
+                key_value& block = *task.m_block;
+
+                if ( !std::holds_alternative<key_value::lazy_t>( block.m_var ) )
+                {
+                    std::pmr::memory_resource* resource = block.resource( );
+                    block.m_var = key_value::lazy_t{ std::pmr::vector<std::pair<const char*, u32>>{ resource }, resource, text( ) };
+                    block.m_state.store( key_value::lazy, std::memory_order_release );
+                }
+
+                std::get<key_value::lazy_t>( block.m_var ).m_bodies.emplace_back( task.m_body, task.m_line );
+            }
+
+            return true;
+        }
+
+        // Same result as parse( ) but blocks at split_depth are parsed on up to threads threads
+        // A brace scan finds the blocks, each one is parsed on its own and merged back in document order
+        // Depth 3 splits items_game into single items, paint kits, prefabs...
+        // Only keys above split_depth are interned, the intern table isn't shared between threads
+        bool parse_parallel( u32 threads = 0, u32 split_depth = 3 )
+        {
+            kv_stats::timer_t timer{ kv_stats::parse };
+
+            m_root.map( ).clear( );
+            m_keys.clear( );
+
+            kv_reader reader{ text( ) };
+            splitter_t splitter{ m_root, text( ), reader, split_depth, &m_keys };
+
+            if ( !reader.parse( splitter ) )
+            {
                 m_root.map( ).clear( );
                 return false;
             }
 
+            auto& tasks = splitter.m_tasks;
+            std::pmr::memory_resource* memory = resource( );
+            std::pmr::vector<key_value> blocks( tasks.size( ), key_value{ std::string_view{}, memory }, memory );
+            std::atomic<bool> failed{ false };
+
+            parallel_for( tasks.size( ), [ & ]( usize i )
+            {
+                if ( failed.load( std::memory_order_relaxed ) )
+                    return;
+
+#ifdef KV_STATS
+                blocks[ i ].m_lookups = m_root.m_lookups;
+#endif
+                builder_t builder{ blocks[ i ], text( ) };
+                kv_reader block_reader = kv_reader::block_body( tasks[ i ].m_body, tasks[ i ].m_line );
+
+                if ( !block_reader.parse( builder ) )
+                    failed = true;
+            }, threads );
+
+            if ( failed )
+            {
+                m_root.map( ).clear( );
+                return false;
+            }
+
+            for ( usize i = 0; i < tasks.size( ); ++i )
+                merge( *tasks[ i ].m_block, blocks[ i ] );
+
             return true;
         }
 
@@ -486,53 +1939,207 @@ namespace valve
         {
             return m_root;
         }
+        // Text the tree points into
+        const char* text( ) const
+        {
+            if ( m_mapping.is_open( ) )
+                return m_mapping.c_str( );
+
+            return m_string.empty( ) ? m_data.c_str( ) : m_string.c_str( );
+        }
+        bool is_mapped( ) const
+        {
+            return m_mapping.is_open( );
+        }
+        // Resource passed in the constructor
+        std::pmr::memory_resource* resource( ) const
+        {
+            return m_root.resource( );
+        }
+        // Lookup hits and misses on nodes parsed into this file, zeros without KV_STATS
+        kv_stats::lookups_t lookups( ) const
+        {
+#ifdef KV_STATS
+            return kv_stats::lookups_t{ m_lookups->m_hits.load( std::memory_order_relaxed ), m_lookups->m_misses.load( std::memory_order_relaxed ) };
+#else
+            return kv_stats::lookups_t{ };
+#endif
+        }
+        // Copy string into storage owned by this file, for keys and values added after parsing
+        std::string_view store( std::string_view str )
+        {
+            return m_pool.store( str );
+        }
+        // Hashed key for repeated lookups, shares text with the tree when the key exists in this file
+        kv_key intern( std::string_view key ) const
+        {
+            return m_keys.find( key );
+        }
 
-        key_value* find( std::string_view key )
+        key_value* find( const kv_key& key )
         {
             return m_root.find( key );
         }
-        key_value* find_block( std::string_view key )
+        key_value* find_block( const kv_key& key )
         {
             return m_root.find_block( key );
         }
-        key_value* find_value( std::string_view key )
+        key_value* find_value( const kv_key& key )
         {
             return m_root.find_value( key );
         }
         // Unsafe
-        key_value& operator[]( std::string_view key )
+        key_value& operator[]( const kv_key& key )
         {
             return *find( key );
         }
 
-        void write( const fs::path& path )
+        bool write( const fs::path& path, kv_write_options options = {} )
         {
-            std::ofstream out( path, std::ios::binary );
-
-            write_block( out, m_root, 0 );
+            return kv_writer::write( m_root, path, options );
+        }
+        // Appends the text to out, false if a string ends in a backslash and won't read back
+        bool write( std::string& out, kv_write_options options = {} )
+        {
+            return kv_writer{ out, options }.write( m_root );
         }
 
     private:
-        void write_block( std::ofstream& out, key_value& block, u32 depth )
+        // Maps or reads the file into memory
+        bool read( const fs::path& file, load_mode mode )
         {
-            std::string depth_pad( depth, '\t' );
+            kv_stats::timer_t timer{ kv_stats::load };
 
-            for ( auto& [key, kv] : block.map( ) )
+            release_string( );
+
+            if ( mode == load_mode::map && m_mapping.open( file ) && m_mapping.null_terminated( ) )
+            {
+                m_data.clear( );
+                m_data.shrink_to_fit( );
+                return true;
+            }
+
+            m_mapping.close( );
+
+            std::ifstream in( file, std::ios::binary );
+
+            if ( !in.good( ) )
+                return false;
+
+            size_t size = fs::file_size( file );
+
+            m_data.resize( size );
+            in.read( m_data.data( ), size );
+            keep_on_heap( m_data );
+            return true;
+        }
+        // Copies the children of source into target allocating from this file, strings go into the pool
+        void copy_tree( key_value& target, key_value& source )
+        {
+            key_value::kv_map_t& map = target.parsed_map( );
+
+            for ( auto& [k, v] : source.map( ) )
             {
-                if ( kv.type( ) == key_value::value_type::VALUE )
-                    fmt::print( out, "{}\"{}\" \"{}\"\n", depth_pad, key, kv.value( ).as_str_v( ) );
-                else if ( kv.type( ) == key_value::value_type::BLOCK )
+                kv_key key{ m_pool.store( k.m_key ), k.m_hash };
+                key_value kv = v.type( ) == key_value::value_type::VALUE ?
+                    key_value{ key, m_pool.store( v.value( ).as_str_v( ) ) } :
+                    key_value{ key, map.get_allocator( ).resource( ) };
+
+                kv.m_position = v.m_position;
+#ifdef KV_STATS
+                kv.m_lookups = target.m_lookups;
+#endif
+                key_value& copy = map.try_emplace( key, std::move( kv ) ).first->second;
+
+                if ( copy.type( ) == key_value::value_type::BLOCK )
                 {
-                    fmt::print( out, "{0}\"{1}\"\n{0}{{\n", depth_pad, key );
-                    write_block( out, kv, depth + 1 );
-                    fmt::print( out, "{}}}\n", depth_pad );
+                    copy_tree( copy, v );
+
+                    if ( v.parse_failed( ) )
+                        copy.m_state.store( key_value::failed, std::memory_order_relaxed );
                 }
             }
         }
+        // Frees the text taken over from a std::string, loads put the text in m_data or the mapping
+        void release_string( )
+        {
+            m_string = std::string{ };
+        }
+        // Owned text stays on the heap so its address survives moving the file, a short string would move with it
+        template <typename S>
+        static void keep_on_heap( S& str )
+        {
+            if ( str.capacity( ) < sizeof( S ) )
+                str.reserve( sizeof( S ) );
+        }
+
+        // Moves source entries into target, entries already in target win like duplicate keys do while parsing
+        static void merge( key_value& target, key_value& source )
+        {
+            key_value::kv_map_t& dst = target.map( );
+            key_value::kv_map_t& src = source.map( );
+
+            if ( dst.empty( ) )
+            {
+                dst.swap( src );
+                return;
+            }
+
+            for ( auto& [key, kv] : src )
+            {
+                auto [it, inserted] = dst.try_emplace( key, std::move( kv ) );
+
+                if ( !inserted && it->second.type( ) == key_value::value_type::BLOCK && kv.type( ) == key_value::value_type::BLOCK )
+                    merge( it->second, kv );
+                else if ( !inserted )
+                    kv_stats::add( kv_stats::duplicates_dropped );
+            }
+        }
 
     private:
-        parser_t         m_parser{ nullptr };
-        key_value        m_root{ "root" };
-        std::string      m_data;
+        key_value        m_root;
+        std::pmr::string m_data;
+        std::string      m_string;      // Text moved in through kv_file( std::string&& )
+        mapped_file      m_mapping;
+        string_pool      m_pool;
+        kv_intern_table  m_keys;
+#ifdef KV_STATS
+        std::unique_ptr<kv_stats::lookup_counters_t> m_lookups;
+#endif
     };
+
+    inline key_value::kv_map_t& key_value::map( )
+    {
+        if ( is_loaded( ) )
+            return parsed_map( );
+
+        std::lock_guard<std::mutex> lock( lazy_lock( ) );
+
+        // Another thread got here first
+        if ( m_state.load( std::memory_order_relaxed ) != lazy )
+            return parsed_map( );
+
+        kv_stats::timer_t timer{ kv_stats::parse };
+
+        lazy_t bodies = std::move( std::get<lazy_t>( m_var ) );
+        m_var.emplace<kv_map_t>( bodies.m_resource );
+        load_state state = loaded;
+
+        // Duplicate blocks in document order so first value still wins
+        for ( auto& [body, line] : bodies.m_bodies )
+        {
+            kv_file::builder_t builder{ *this, bodies.m_text };
+            kv_reader reader = kv_reader::block_body( body, line );
+
+            if ( !reader.parse( builder ) )
+            {
+                parsed_map( ).clear( );
+                state = failed;
+                break;
+            }
+        }
+
+        m_state.store( state, std::memory_order_release );
+        return parsed_map( );
+    }
 }
\ No newline at end of file
@@ -0,0 +1,122 @@
+#pragma once
+
+#include "kv.hpp"
+
+#include <vector>
+#include <string>
+#include <numeric>
+#include <algorithm>
+#include <exception>
+
+namespace valve
+{
+    // One input of a batch, a file on disk or text already in memory that has to outlive the load
+    struct kv_batch_source
+    {
+        static kv_batch_source file( const fs::path& path, load_mode mode = load_mode::read )
+        {
+            return kv_batch_source{ path, {}, mode, true };
+        }
+        static kv_batch_source text( std::string_view text, std::string_view name = {} )
+        {
+            return kv_batch_source{ fs::u8path( name ), text, load_mode::read, false };
+        }
+
+        fs::path         m_path;        // Name for text sources, only used in errors
+        std::string_view m_text;
+        load_mode        m_mode;
+        bool             m_is_file;
+    };
+
+    template <typename T>
+    struct kv_batch_result
+    {
+        explicit operator bool( ) const
+        {
+            return m_value.has_value( );
+        }
+
+        std::optional<T> m_value;
+        std::string      m_error;       // Empty when m_value is set
+    };
+
+    // Loads many files at once on a bounded number of threads, each thread reads and then parses its file so
+    // reading one file overlaps parsing the others, results come back in the order of the sources
+    // T is anything with from_file( path, mode ) and from_string( text ) like kv_file, kv_flat_file,
+    // csgo::language and csgo::items_game
+    class kv_batch
+    {
+    public:
+        // threads 0 means one per hardware thread
+        template <typename T>
+        static std::vector<kv_batch_result<T>> load( const std::vector<kv_batch_source>& sources, u32 threads = 0 )
+        {
+            std::vector<kv_batch_result<T>> results( sources.size( ) );
+
+            // Biggest first so a large file doesn't start last and finish long after the rest
+            std::vector<usize> order( sources.size( ) );
+            std::vector<u64> sizes( sources.size( ) );
+            std::iota( order.begin( ), order.end( ), usize{ 0 } );
+
+            for ( usize i = 0; i < sources.size( ); ++i )
+            {
+                std::error_code ec;
+                sizes[ i ] = sources[ i ].m_is_file ? fs::file_size( sources[ i ].m_path, ec ) : sources[ i ].m_text.size( );
+
+                if ( ec )
+                    sizes[ i ] = 0;
+            }
+
+            std::stable_sort( order.begin( ), order.end( ), [ & ]( usize a, usize b ) { return sizes[ a ] > sizes[ b ]; } );
+
+            parallel_for( order.size( ), [ & ]( usize i )
+            {
+                usize idx = order[ i ];
+                results[ idx ] = load_one<T>( sources[ idx ] );
+            }, threads );
+
+            return results;
+        }
+        template <typename T>
+        static std::vector<kv_batch_result<T>> load( const std::vector<fs::path>& paths, load_mode mode = load_mode::read, u32 threads = 0 )
+        {
+            std::vector<kv_batch_source> sources;
+            sources.reserve( paths.size( ) );
+
+            for ( const fs::path& path : paths )
+                sources.push_back( kv_batch_source::file( path, mode ) );
+
+            return load<T>( sources, threads );
+        }
+
+    private:
+        // parallel_for workers must not throw, filesystem and allocation errors end up in the result
+        template <typename T>
+        static kv_batch_result<T> load_one( const kv_batch_source& source )
+        {
+            kv_batch_result<T> result;
+
+            try
+            {
+                result.m_value = source.m_is_file ? T::from_file( source.m_path, source.m_mode ) : T::from_string( source.m_text );
+
+                if ( result.m_value )
+                    return result;
+
+                std::error_code ec;
+
+                if ( source.m_is_file && !fs::is_regular_file( source.m_path, ec ) )
+                    result.m_error = fmt::format( "{}: file not found", source.m_path.u8string( ) );
+                else
+                    result.m_error = fmt::format( "{}: failed to read or parse", source.m_path.u8string( ) );
+            }
+            catch ( const std::exception& e )
+            {
+                result.m_value.reset( );
+                result.m_error = fmt::format( "{}: {}", source.m_path.u8string( ), e.what( ) );
+            }
+
+            return result;
+        }
+    };
+}
@@ -0,0 +1,307 @@
+#pragma once
+
+#include "kv.hpp"
+
+namespace valve
+{
+    // Binary KeyValues (KV1) reader and writer, gives the same key_value tree as the text format
+    // Every node is a type byte, a null terminated key and a payload, blocks end with type end
+    // Keys and strings point straight into the loaded buffer, numbers are converted to text in the kv_file string pool
+    class kv_binary
+    {
+    public:
+        enum class type_t : u8
+        {
+            block       = 0,
+            string      = 1,
+            int32       = 2,
+            float32     = 3,
+            pointer     = 4,
+            wstring     = 5,
+            color       = 6,
+            uint64      = 7,
+            end         = 8,
+            int64       = 10,
+            alt_end     = 11
+        };
+
+        // load_mode::map reads straight from the mapping
+        static std::optional<kv_file> from_file( const fs::path& file, load_mode mode = load_mode::map,
+            std::pmr::memory_resource* resource = kv_stats::default_resource( ) )
+        {
+            kv_file kvf{ resource };
+
+            if ( !load( kvf, file, mode ) )
+                return std::nullopt;
+
+            return kvf;
+        }
+        static std::optional<kv_file> from_string( std::string_view str, std::pmr::memory_resource* resource = kv_stats::default_resource( ) )
+        {
+            kv_file kvf{ resource };
+
+            if ( !load( kvf, str ) )
+                return std::nullopt;
+
+            return kvf;
+        }
+
+        // Load and parse binary file into kvf
+        static bool load( kv_file& kvf, const fs::path& file, load_mode mode = load_mode::map )
+        {
+            if ( !read( kvf, file, mode ) )
+                return false;
+
+            if ( kvf.m_mapping.is_open( ) )
+                return parse( kvf, kvf.m_mapping.data( ), kvf.m_mapping.size( ) );
+
+            return parse( kvf, reinterpret_cast< const u8* >( kvf.m_data.data( ) ), kvf.m_data.size( ) );
+        }
+        // Load and parse binary data into kvf
+        static bool load( kv_file& kvf, std::string_view str )
+        {
+            {
+                kv_stats::timer_t timer{ kv_stats::load };
+                kvf.m_mapping.close( );
+                kvf.release_string( );
+                kvf.m_data.assign( str.data( ), str.size( ) );
+                kv_file::keep_on_heap( kvf.m_data );
+            }
+
+            return parse( kvf, reinterpret_cast< const u8* >( kvf.m_data.data( ) ), kvf.m_data.size( ) );
+        }
+
+        // Values are written as strings so text files convert without losing anything
+        static void write( key_value& root, std::string& out )
+        {
+            write_block( out, root );
+            out += static_cast< char >( type_t::end );
+        }
+        static bool write( key_value& root, const fs::path& path )
+        {
+            std::string out;
+            write( root, out );
+
+            std::ofstream file( path, std::ios::binary );
+
+            if ( !file.good( ) )
+                return false;
+
+            file.write( out.data( ), out.size( ) );
+            return file.good( );
+        }
+        static bool write( kv_file& kvf, const fs::path& path )
+        {
+            return write( kvf.root( ), path );
+        }
+
+    private:
+        // Maps or reads the file into kvf, binary files don't need the terminating '\0' a text mapping does
+        static bool read( kv_file& kvf, const fs::path& file, load_mode mode )
+        {
+            kv_stats::timer_t timer{ kv_stats::load };
+            kvf.release_string( );
+
+            if ( mode == load_mode::map && kvf.m_mapping.open( file ) )
+            {
+                kvf.m_data.clear( );
+                kvf.m_data.shrink_to_fit( );
+                return true;
+            }
+
+            kvf.m_mapping.close( );
+
+            std::ifstream in( file, std::ios::binary );
+
+            if ( !in.good( ) )
+                return false;
+
+            kvf.m_data.resize( fs::file_size( file ) );
+            in.read( kvf.m_data.data( ), kvf.m_data.size( ) );
+            kv_file::keep_on_heap( kvf.m_data );
+            return true;
+        }
+
+        static bool parse( kv_file& kvf, const u8* data, usize size )
+        {
+            kv_stats::timer_t timer{ kv_stats::parse };
+
+            kvf.m_root.map( ).clear( );
+            kvf.m_pool.clear( );
+
+            kv_file::builder_t builder{ kvf.m_root, reinterpret_cast< const char* >( data ) };
+
+            const u8* ptr = data;
+            const u8* end = data + size;
+            u32 depth = 0;
+            // Nesting inside a block that is dropped because its key is used by a value
+            u32 skip = 0;
+
+            auto fail = [ & ]( [[maybe_unused]] const char* msg ) -> bool
+            {
+#ifdef KV_PRINT_ERRORS
+                fmt::print( "{} at offset {}\n", msg, static_cast< usize >( ptr - data ) );
+#endif // KV_PRINT_ERRORS
+                kvf.m_root.map( ).clear( );
+                kvf.m_pool.clear( );
+                return false;
+            };
+
+            auto read_string = [ & ]( std::string_view& str ) -> bool
+            {
+                const u8* terminator = static_cast< const u8* >( std::memchr( ptr, '\0', end - ptr ) );
+
+                if ( !terminator )
+                    return false;
+
+                str = std::string_view{ reinterpret_cast< const char* >( ptr ), static_cast< usize >( terminator - ptr ) };
+                ptr = terminator + 1;
+                return true;
+            };
+
+            auto read = [ & ]( auto& value ) -> bool
+            {
+                if ( static_cast< usize >( end - ptr ) < sizeof( value ) )
+                    return false;
+
+                std::memcpy( &value, ptr, sizeof( value ) );
+                ptr += sizeof( value );
+                return true;
+            };
+
+            auto number = [ & ]( auto value ) -> std::string_view
+            {
+                char buffer[ 32 ];
+                char* last = fmt::format_to( buffer, "{}", value );
+                return kvf.m_pool.store( std::string_view{ buffer, static_cast< usize >( last - buffer ) } );
+            };
+
+            // Missing final end marker is fine
+            while ( ptr < end )
+            {
+                type_t type = static_cast< type_t >( *ptr++ );
+
+                if ( type == type_t::end || type == type_t::alt_end )
+                {
+                    if ( skip )
+                    {
+                        --skip;
+                        continue;
+                    }
+
+                    if ( !depth )
+                        break;
+
+                    --depth;
+                    builder.block_end( );
+                    continue;
+                }
+
+                std::string_view key;
+                if ( !read_string( key ) )
+                    return fail( "Unterminated key" );
+
+                std::string_view value;
+
+                switch ( type )
+                {
+                case type_t::block:
+                {
+                    if ( skip )
+                        ++skip;
+                    else if ( builder.block_begin( key ) == kv_action::skip )
+                        skip = 1;
+                    else
+                    {
+                        ++depth;
+                        kv_stats::max( kv_stats::max_depth, depth );
+                    }
+                    continue;
+                }
+                case type_t::string:
+                {
+                    if ( !read_string( value ) )
+                        return fail( "Unterminated string" );
+                    break;
+                }
+                case type_t::int32:
+                case type_t::pointer:
+                {
+                    i32 v;
+                    if ( !read( v ) )
+                        return fail( "Truncated value" );
+                    value = number( v );
+                    break;
+                }
+                case type_t::float32:
+                {
+                    f32 v;
+                    if ( !read( v ) )
+                        return fail( "Truncated value" );
+                    value = number( v );
+                    break;
+                }
+                case type_t::color:
+                {
+                    u8 v[ 4 ];
+                    if ( !read( v ) )
+                        return fail( "Truncated value" );
+
+                    char buffer[ 16 ];
+                    char* last = fmt::format_to( buffer, "{} {} {} {}", v[ 0 ], v[ 1 ], v[ 2 ], v[ 3 ] );
+                    value = kvf.m_pool.store( std::string_view{ buffer, static_cast< usize >( last - buffer ) } );
+                    break;
+                }
+                case type_t::uint64:
+                {
+                    u64 v;
+                    if ( !read( v ) )
+                        return fail( "Truncated value" );
+                    value = number( v );
+                    break;
+                }
+                case type_t::int64:
+                {
+                    i64 v;
+                    if ( !read( v ) )
+                        return fail( "Truncated value" );
+                    value = number( v );
+                    break;
+                }
+                default:
+                    // wstring isn't supported by valve either
+                    return fail( "Unsupported value type" );
+                }
+
+                if ( !skip )
+                    builder.value( key, value );
+            }
+
+            kv_stats::add( kv_stats::bytes_scanned, static_cast< u64 >( ptr - data ) );
+            return true;
+        }
+
+        static void write_block( std::string& out, key_value& block )
+        {
+            for ( auto& [key, kv] : block.map( ) )
+            {
+                bool is_block = kv.type( ) == key_value::value_type::BLOCK;
+
+                out += static_cast< char >( is_block ? type_t::block : type_t::string );
+                out += key;
+                out += '\0';
+
+                if ( is_block )
+                {
+                    write_block( out, kv );
+                    out += static_cast< char >( type_t::end );
+                }
+                else
+                {
+                    out += kv.value( ).as_str_v( );
+                    out += '\0';
+                }
+            }
+        }
+    };
+}
@@ -0,0 +1,227 @@
+#pragma once
+
+#include "kv.hpp"
+
+#include <vector>
+#include <algorithm>
+
+namespace valve
+{
+    // Differences between two key_value trees as a list of operations on paths
+    // Keys compare case insensitive like find, values compare exact
+    // A patch owns copies of every key and value in it so neither tree has to outlive it
+    class kv_patch
+    {
+    public:
+        // Move only, the keys and values in m_ops point into m_strings
+        kv_patch( ) = default;
+        kv_patch( const kv_patch& ) = delete;
+        kv_patch& operator=( const kv_patch& ) = delete;
+        kv_patch( kv_patch&& ) = default;
+        kv_patch& operator=( kv_patch&& ) = default;
+
+        enum class op_type
+        {
+            add,        // Key only in the new tree
+            remove,     // Key only in the old tree
+            change      // Value changed or a value became a block or the other way around, whole node is replaced
+        };
+
+        struct op_t
+        {
+            op_type                  m_type;
+            std::vector<kv_key>      m_path;    // Keys from the root down to the node, the last one is the node's key
+            std::optional<key_value> m_node;    // New node for add and change
+
+            // Path joined with / like kv_query paths
+            std::string path( ) const
+            {
+                std::string out;
+
+                for ( const kv_key& key : m_path )
+                {
+                    if ( !out.empty( ) )
+                        out += '/';
+                    out += key.m_key;
+                }
+
+                return out;
+            }
+        };
+
+        // Operations that turn from into to, blocks that exist in both are compared key by key
+        static kv_patch diff( key_value& from, key_value& to )
+        {
+            kv_patch patch;
+            std::vector<kv_key> path;
+
+            if ( from.type( ) == key_value::value_type::BLOCK && to.type( ) == key_value::value_type::BLOCK )
+                patch.diff_block( from, to, path );
+
+            return patch;
+        }
+        static kv_patch diff( kv_file& from, kv_file& to )
+        {
+            return diff( from.root( ), to.root( ) );
+        }
+
+        // Applies every operation to target, new strings are stored in target
+        // Returns false if any operation didn't fit the tree ( missing parent or key ), the others are still applied
+        bool apply( kv_file& target )
+        {
+            bool ok = true;
+
+            for ( op_t& op : m_ops )
+            {
+                key_value* parent = &target.root( );
+
+                for ( usize i = 0; parent && i + 1 < op.m_path.size( ); ++i )
+                    parent = parent->find_block( op.m_path[ i ] );
+
+                if ( !parent )
+                {
+                    ok = false;
+                    continue;
+                }
+
+                key_value::kv_map_t& map = parent->map( );
+                const kv_key& key = op.m_path.back( );
+
+                if ( op.m_type == op_type::remove )
+                {
+                    ok = map.erase( key ) && ok;
+                    continue;
+                }
+
+                bool exists = map.find( key ) != map.end( );
+
+                if ( exists != ( op.m_type == op_type::change ) )
+                {
+                    ok = false;
+                    continue;
+                }
+
+                map.erase( key );
+
+                key_value node = copy( *op.m_node, [ & ]( std::string_view str ) { return target.store( str ); }, map.get_allocator( ).resource( ) );
+                kv_key stored_key = kv_key{ node.key( ).as_str_v( ), key.m_hash };
+                map.try_emplace( stored_key, std::move( node ) );
+            }
+
+            return ok;
+        }
+
+        const std::vector<op_t>& ops( ) const
+        {
+            return m_ops;
+        }
+        bool empty( ) const
+        {
+            return m_ops.empty( );
+        }
+        usize size( ) const
+        {
+            return m_ops.size( );
+        }
+
+        // Distinct paths cut to depth keys, depth 3 gives items_game/items/<id> for everything that changed inside an item
+        // Meant for invalidating caches that are built per item, paint kit...
+        std::vector<std::string> changed( u32 depth ) const
+        {
+            std::vector<std::string> out;
+
+            for ( const op_t& op : m_ops )
+            {
+                std::string path;
+
+                for ( usize i = 0; i < op.m_path.size( ) && i < depth; ++i )
+                {
+                    if ( !path.empty( ) )
+                        path += '/';
+                    path += op.m_path[ i ].m_key;
+                }
+
+                out.push_back( std::move( path ) );
+            }
+
+            std::sort( out.begin( ), out.end( ) );
+            out.erase( std::unique( out.begin( ), out.end( ) ), out.end( ) );
+            return out;
+        }
+
+    private:
+        void diff_block( key_value& from, key_value& to, std::vector<kv_key>& path )
+        {
+            for ( auto& [key, old_kv] : from.map( ) )
+            {
+                path.push_back( key );
+
+                key_value* new_kv = to.find( key );
+
+                if ( !new_kv )
+                    add_op( op_type::remove, path, nullptr );
+                else if ( old_kv.type( ) != new_kv->type( ) )
+                    add_op( op_type::change, path, new_kv );
+                else if ( old_kv.type( ) == key_value::value_type::VALUE )
+                {
+                    if ( old_kv.value( ).as_str_v( ) != new_kv->value( ).as_str_v( ) )
+                        add_op( op_type::change, path, new_kv );
+                }
+                else
+                    diff_block( old_kv, *new_kv, path );
+
+                path.pop_back( );
+            }
+
+            for ( auto& [key, new_kv] : to.map( ) )
+            {
+                if ( from.find( key ) )
+                    continue;
+
+                path.push_back( key );
+                add_op( op_type::add, path, &new_kv );
+                path.pop_back( );
+            }
+        }
+
+        void add_op( op_type type, const std::vector<kv_key>& path, key_value* node )
+        {
+            op_t op{ type, {}, std::nullopt };
+            op.m_path.reserve( path.size( ) );
+
+            for ( const kv_key& key : path )
+                op.m_path.push_back( kv_key{ m_strings.store( key.m_key ), key.m_hash } );
+
+            if ( node )
+                op.m_node = copy( *node, [ & ]( std::string_view str ) { return m_strings.store( str ); }, kv_stats::default_resource( ) );
+
+            m_ops.push_back( std::move( op ) );
+        }
+
+        // Deep copy with every string moved into storage by store and every block allocated from resource
+        template <typename S>
+        static key_value copy( key_value& kv, S&& store, std::pmr::memory_resource* resource )
+        {
+            std::string_view key_text = kv.key( ).as_str_v( );
+            kv_key key{ store( key_text ), kv_key::hash( key_text ) };
+
+            if ( kv.type( ) == key_value::value_type::VALUE )
+                return key_value{ key, store( kv.value( ).as_str_v( ) ) };
+
+            key_value block{ key, resource };
+
+            for ( auto& [child_key, child] : kv.map( ) )
+            {
+                key_value child_copy = copy( child, store, resource );
+                kv_key stored_key = kv_key{ child_copy.key( ).as_str_v( ), child_key.m_hash };
+                block.map( ).try_emplace( stored_key, std::move( child_copy ) );
+            }
+
+            return block;
+        }
+
+    private:
+        std::vector<op_t> m_ops;
+        string_pool       m_strings;
+    };
+}
@@ -0,0 +1,1020 @@
+#pragma once
+
+#include "kv.hpp"
+
+#include <vector>
+#include <algorithm>
+#include <memory>
+#include <random>
+#include <unordered_map>
+
+namespace valve
+{
+    class kv_flat_file;
+    struct kv_flat_tree_t;
+    struct kv_flat_node_t;
+
+    // Lightweight handle to a node inside kv_flat_file arena, invalid handles evaluate to false
+    class kv_node
+    {
+        friend class kv_flat_file;
+
+    public:
+        using value_type = key_value::value_type;
+
+        struct iterator
+        {
+            kv_node operator*( ) const
+            {
+                return kv_node{ m_tree, m_index };
+            }
+            void operator++( ) // prefix
+            {
+                ++m_index;
+            }
+            bool operator==( iterator other ) const
+            {
+                return m_index == other.m_index;
+            }
+            bool operator!=( iterator other ) const
+            {
+                return m_index != other.m_index;
+            }
+
+            const kv_flat_tree_t* m_tree;
+            u32                   m_index;
+        };
+
+        kv_node( ) = default;
+
+        value_type type( ) const;
+        value_t key( ) const;
+        value_t value( ) const;
+
+        kv_node find( const kv_key& key ) const;
+        kv_node find_block( const kv_key& key ) const
+        {
+            if ( kv_node kv = find( key ); kv && kv.type( ) == value_type::BLOCK )
+                return kv;
+
+            return kv_node{};
+        }
+        kv_node find_value( const kv_key& key ) const
+        {
+            if ( kv_node kv = find( key ); kv && kv.type( ) == value_type::VALUE )
+                return kv;
+
+            return kv_node{};
+        }
+        kv_node find_recursive( const kv_key& key ) const;
+
+        // Child count of a block
+        usize size( ) const;
+        iterator begin( ) const;
+        iterator end( ) const;
+
+        explicit operator bool( ) const
+        {
+            return m_tree;
+        }
+        // So lookups can be chained like key_value pointers
+        const kv_node* operator->( ) const
+        {
+            return this;
+        }
+        // Unsafe
+        kv_node operator[]( const kv_key& key ) const
+        {
+            return find( key );
+        }
+
+    private:
+        kv_node( const kv_flat_tree_t* tree, u32 index ) : m_tree{ tree }, m_index{ index } {}
+
+        const kv_flat_node_t& node( ) const;
+
+        const kv_flat_tree_t* m_tree{ nullptr };
+        u32                   m_index{ 0 };
+    };
+
+    struct kv_flat_node_t
+    {
+        u32                   m_key;        // offset of the key in the text
+        u32                   m_key_size;
+        u32                   m_hash;       // case insensitive hash of the key
+        u32                   m_data;       // value offset in the text or first child index
+        u32                   m_size;       // value size or child count
+        u32                   m_index;      // offset of the block perfect hash index, npos for small blocks
+        key_value::value_type m_type;
+        u8                    m_pad[ 3 ]{}; // explicit and zeroed so snapshots hold no indeterminate bytes
+    };
+    // Arena header, kept separate from kv_flat_file so handles survive moving the file
+    struct kv_flat_tree_t
+    {
+        const char*            m_text{ nullptr };
+        const kv_flat_node_t*  m_nodes{ nullptr };
+        const u32*             m_index{ nullptr };
+        u32                    m_node_count{ 0 };
+        u32                    m_index_size{ 0 };
+        u32                    m_string_size{ 0 };  // strings stored in the arena, 0 when pointing into a parsed text
+        std::unique_ptr<u8[]>  m_arena;
+    };
+
+    // Identifies the source text a snapshot was made from
+    struct kv_snapshot_key
+    {
+        u64 m_hash{ 0 };
+        u64 m_size{ 0 };
+        i64 m_mtime{ 0 };
+
+        static std::optional<kv_snapshot_key> from_file( const fs::path& file )
+        {
+            std::error_code ec;
+            auto mtime = fs::last_write_time( file, ec );
+
+            if ( ec )
+                return std::nullopt;
+
+            mapped_file mapping;
+
+            if ( !mapping.open( file ) )
+                return std::nullopt;
+
+            return kv_snapshot_key{ hash( mapping.data( ), mapping.size( ) ), mapping.size( ), static_cast< i64 >( mtime.time_since_epoch( ).count( ) ) };
+        }
+
+        // Not cryptographic, only has to notice the file changed, 8 bytes per step
+        static u64 hash( const u8* data, usize size )
+        {
+            u64 hash = 0xcbf29ce484222325 ^ size;
+            usize i = 0;
+
+            for ( ; i + 8 <= size; i += 8 )
+            {
+                u64 word;
+                std::memcpy( &word, data + i, 8 );
+                hash = ( hash ^ word ) * 0x100000001b3;
+                hash ^= hash >> 29;
+            }
+
+            for ( ; i < size; ++i )
+                hash = ( hash ^ data[ i ] ) * 0x100000001b3;
+
+            return hash;
+        }
+
+        bool operator==( const kv_snapshot_key& other ) const
+        {
+            return m_hash == other.m_hash && m_size == other.m_size && m_mtime == other.m_mtime;
+        }
+    };
+
+    // kv_file that keeps every node in one contiguous arena instead of a map per block
+    // Children of a block are a range of consecutive nodes, blocks with many children get a minimal perfect hash index
+    // Duplicate keys follow kv_file rules, first value wins and blocks with the same key are merged
+    // Never changes after loading so any number of threads can read it without locking
+    class kv_flat_file
+    {
+        friend class kv_node;
+
+        static constexpr u32 npos = ~0u;
+
+        static constexpr char snapshot_magic[ 8 ] = { 'K', 'V', 'F', 'L', 'A', 'T', '\0', '\0' };
+        static constexpr u32 snapshot_version = 1;
+
+        struct snapshot_header_t
+        {
+            char            m_magic[ 8 ];
+            u32             m_version;
+            u32             m_node_size;
+            kv_snapshot_key m_source;
+            u32             m_node_count;
+            u32             m_index_size;
+            u32             m_string_size;
+            u32             m_reserved;
+        };
+        // Blocks with less children are searched linearly
+        static constexpr u32 index_threshold = 16;
+
+        // Nodes in document order while parsing, laid out breadth first afterwards
+        struct build_node_t
+        {
+            u32                   m_key;
+            u32                   m_key_size;
+            u32                   m_hash;
+            u32                   m_data;
+            u32                   m_size;
+            u32                   m_parent;
+            u32                   m_first_child{ npos };
+            u32                   m_last_child{ npos };
+            u32                   m_next_sibling{ npos };
+            key_value::value_type m_type;
+        };
+
+        // Collects nodes in document order from kv_reader events
+        struct builder_t : kv_visitor
+        {
+            builder_t( const char* text, usize size ) : m_text{ text }
+            {
+                m_nodes.reserve( size / 32 + 1 );
+                m_nodes.push_back( build_node_t{ 0, 0, 0, 0, 0, npos, npos, npos, npos, key_value::value_type::BLOCK } );
+                m_lookup.assign( 1024, npos );
+                m_scope.push_back( 0 );
+            }
+
+            kv_action value( std::string_view key, std::string_view value )
+            {
+                u32 parent = m_scope.back( );
+                u32 hash = kv_key::hash( key );
+
+                // First value wins
+                if ( lookup_find( parent, key, hash ) != npos )
+                {
+                    kv_stats::add( kv_stats::duplicates_dropped );
+                    return kv_action::next;
+                }
+
+                u32 idx = add_node( parent, key, hash, key_value::value_type::VALUE );
+                m_nodes[ idx ].m_data = static_cast< u32 >( value.data( ) - m_text );
+                m_nodes[ idx ].m_size = static_cast< u32 >( value.size( ) );
+                return kv_action::next;
+            }
+            kv_action block_begin( std::string_view key )
+            {
+                u32 parent = m_scope.back( );
+                u32 hash = kv_key::hash( key );
+
+                // Find block if it already exists
+                u32 block = lookup_find( parent, key, hash );
+
+                if ( block == npos )
+                    block = add_node( parent, key, hash, key_value::value_type::BLOCK );
+
+                // Key already used by a value, first one wins
+                else if ( m_nodes[ block ].m_type != key_value::value_type::BLOCK )
+                {
+                    kv_stats::add( kv_stats::duplicates_dropped );
+                    return kv_action::skip;
+                }
+
+                m_scope.push_back( block );
+                return kv_action::next;
+            }
+            kv_action block_end( )
+            {
+                m_scope.pop_back( );
+                return kv_action::next;
+            }
+
+            u32 add_node( u32 parent, std::string_view key, u32 hash, key_value::value_type type )
+            {
+                u32 idx = static_cast< u32 >( m_nodes.size( ) );
+                m_nodes.push_back( build_node_t{ static_cast< u32 >( key.data( ) - m_text ), static_cast< u32 >( key.size( ) ), hash, 0, 0, parent, npos, npos, npos, type } );
+
+                build_node_t& p = m_nodes[ parent ];
+                if ( p.m_last_child == npos )
+                    p.m_first_child = idx;
+                else
+                    m_nodes[ p.m_last_child ].m_next_sibling = idx;
+                p.m_last_child = idx;
+                ++p.m_size;
+
+                lookup_insert( idx );
+                kv_stats::add( kv_stats::nodes_created );
+                return idx;
+            }
+
+            // Duplicate detection, open addressing over ( parent, key )
+            static u32 lookup_slot( u32 parent, u32 hash )
+            {
+                return hash ^ ( parent * 0x9E3779B1 );
+            }
+            u32 lookup_find( u32 parent, std::string_view key, u32 hash ) const
+            {
+                u32 mask = static_cast< u32 >( m_lookup.size( ) ) - 1;
+
+                for ( u32 i = lookup_slot( parent, hash ) & mask; m_lookup[ i ] != npos; i = ( i + 1 ) & mask )
+                {
+                    const build_node_t& n = m_nodes[ m_lookup[ i ] ];
+
+                    if ( n.m_hash == hash && n.m_parent == parent &&
+                        kv_key::equal( std::string_view{ m_text + n.m_key, n.m_key_size }, key ) )
+                        return m_lookup[ i ];
+                }
+
+                return npos;
+            }
+            void lookup_insert( u32 idx )
+            {
+                // Keep load factor under 0.5
+                if ( ( m_lookup_count + 1 ) * 2 > m_lookup.size( ) )
+                {
+                    kv_stats::add( kv_stats::rehashes );
+
+                    std::vector<u32> old = std::move( m_lookup );
+                    m_lookup.assign( old.size( ) * 2, npos );
+                    m_lookup_count = 0;
+
+                    for ( u32 i : old )
+                    {
+                        if ( i != npos )
+                            lookup_insert( i );
+                    }
+                }
+
+                u32 mask = static_cast< u32 >( m_lookup.size( ) ) - 1;
+                u32 i = lookup_slot( m_nodes[ idx ].m_parent, m_nodes[ idx ].m_hash ) & mask;
+
+                while ( m_lookup[ i ] != npos )
+                    i = ( i + 1 ) & mask;
+
+                m_lookup[ i ] = idx;
+                ++m_lookup_count;
+            }
+
+            const char*               m_text;
+            std::vector<build_node_t> m_nodes;
+            std::vector<u32>          m_lookup;
+            u32                       m_lookup_count{ 0 };
+            std::vector<u32>          m_scope;
+        };
+
+    public:
+        kv_flat_file( ) = default;
+        kv_flat_file( std::string&& str ) : m_data{ std::make_unique<std::string>( std::move( str ) ) } {}
+
+        static std::optional<kv_flat_file> from_file( const fs::path& file, load_mode mode = load_mode::read )
+        {
+            kv_flat_file kvf;
+
+            if ( !kvf.load( file, mode ) )
+                return std::nullopt;
+
+            return kvf;
+        }
+        static std::optional<kv_flat_file> from_string( std::string_view str )
+        {
+            kv_flat_file kvf;
+
+            if ( !kvf.load( str ) )
+                return std::nullopt;
+
+            return kvf;
+        }
+
+        // Load and parse the file, see kv_file::load for load_mode::map
+        bool load( const fs::path& file, load_mode mode = load_mode::read )
+        {
+            if ( !read( file, mode ) )
+                return false;
+
+            return parse( );
+        }
+        // Load and parse the file
+        bool load( std::string_view str )
+        {
+            {
+                kv_stats::timer_t timer{ kv_stats::load };
+                m_mapping.close( );
+                m_data = std::make_unique<std::string>( str );
+            }
+
+            return parse( );
+        }
+
+        // Read only copy of a key_value tree, for files that are edited after parsing like items_game
+        // after flatten_item_prefabs, the source can be dropped afterwards since every string is copied into the arena
+        static kv_flat_file freeze( key_value& root )
+        {
+            std::vector<build_node_t> nodes{ build_node_t{ 0, 0, 0, 0, 0, npos, npos, npos, npos, key_value::value_type::BLOCK } };
+            std::string strings;
+            // Same text is stored once, keys mostly
+            std::unordered_map<std::string_view, u32> offsets;
+
+            auto store = [ & ]( std::string_view str ) -> u32
+            {
+                auto [it, inserted] = offsets.try_emplace( str, static_cast< u32 >( strings.size( ) ) );
+
+                if ( inserted )
+                    strings.append( str );
+
+                return it->second;
+            };
+
+            std::vector<std::pair<key_value*, u32>> stack{ { &root, 0 } };
+            std::vector<std::pair<const kv_key*, key_value*>> children;
+
+            while ( !stack.empty( ) )
+            {
+                auto [block, parent] = stack.back( );
+                stack.pop_back( );
+
+                // Children in document order like a parsed tree, so find_recursive picks the same match as on root
+                children.clear( );
+                for ( auto& [key, kv] : block->map( ) )
+                    children.emplace_back( &key, &kv );
+
+                std::stable_sort( children.begin( ), children.end( ), [ ]( const auto& a, const auto& b )
+                {
+                    return a.second->comes_before( *b.second );
+                } );
+
+                for ( auto [key_ptr, kv_ptr] : children )
+                {
+                    const kv_key& key = *key_ptr;
+                    key_value& kv = *kv_ptr;
+                    u32 idx = static_cast< u32 >( nodes.size( ) );
+                    nodes.push_back( build_node_t{ store( key.m_key ), static_cast< u32 >( key.m_key.size( ) ), key.m_hash, 0, 0, parent, npos, npos, npos, kv.type( ) } );
+
+                    if ( kv.type( ) == key_value::value_type::VALUE )
+                    {
+                        std::string_view value = kv.value( ).as_str_v( );
+                        nodes[ idx ].m_data = store( value );
+                        nodes[ idx ].m_size = static_cast< u32 >( value.size( ) );
+                    }
+                    else
+                        stack.emplace_back( &kv, idx );
+
+                    build_node_t& p = nodes[ parent ];
+                    if ( p.m_last_child == npos )
+                        p.m_first_child = idx;
+                    else
+                        nodes[ p.m_last_child ].m_next_sibling = idx;
+                    p.m_last_child = idx;
+                    ++p.m_size;
+                }
+            }
+
+            kv_flat_file kvf;
+            kvf.compact( nodes, nullptr, strings );
+            return kvf;
+        }
+        static kv_flat_file freeze( kv_file& kvf )
+        {
+            return freeze( kvf.root( ) );
+        }
+
+        // Only call if you passed string in constructor load() calls parse already
+        bool parse( )
+        {
+            kv_stats::timer_t timer{ kv_stats::parse };
+
+            m_tree.reset( );
+
+            const char* data = text( );
+            builder_t builder{ data, text_size( ) };
+            kv_reader reader{ data };
+
+            if ( !reader.parse( builder ) )
+                return false;
+
+            compact( builder.m_nodes, data );
+            return true;
+        }
+
+        kv_node root( ) const
+        {
+            return m_tree ? kv_node{ m_tree.get( ), 0 } : kv_node{};
+        }
+
+        kv_node find( const kv_key& key ) const
+        {
+            return root( ).find( key );
+        }
+        kv_node find_block( const kv_key& key ) const
+        {
+            return root( ).find_block( key );
+        }
+        kv_node find_value( const kv_key& key ) const
+        {
+            return root( ).find_value( key );
+        }
+        // Unsafe
+        kv_node operator[]( const kv_key& key ) const
+        {
+            return find( key );
+        }
+
+        // Loads the snapshot if it was made from file as it is now, otherwise parses file and writes a new snapshot
+        // csgo::items_game and csgo::language don't load from snapshots since their accessors hand out key_value
+        // pointers, freeze( ig.kv( ) ) gives a read only copy of the flattened tree that save_snapshot can store
+        static std::optional<kv_flat_file> from_file_cached( const fs::path& file, const fs::path& snapshot, load_mode mode = load_mode::read )
+        {
+            std::optional<kv_snapshot_key> key = kv_snapshot_key::from_file( file );
+
+            if ( !key )
+                return std::nullopt;
+
+            kv_flat_file kvf;
+
+            if ( kvf.load_snapshot( snapshot, *key ) )
+                return kvf;
+
+            if ( !kvf.load( file, mode ) )
+                return std::nullopt;
+
+            // Failing to write the snapshot only costs the next start
+            kvf.save_snapshot( snapshot, *key );
+            return kvf;
+        }
+
+        // Snapshot layout is the arena as is, header then nodes, indexes and strings, every reference is an offset
+        // so loading maps the file, checks every offset once and points the tree into the mapping
+        // Native byte order and layout, the version and node size in the header reject snapshots from other builds
+        // Written to a temporary file next to path and renamed over it, processes that have the old snapshot
+        // mapped keep reading the old file and concurrent writers never mix their output
+        bool save_snapshot( const fs::path& path, const kv_snapshot_key& source ) const
+        {
+            if ( !m_tree )
+                return false;
+
+            // Parsed trees point into the text so the text is stored as the string table
+            std::string_view strings = m_tree->m_string_size ?
+                std::string_view{ m_tree->m_text, m_tree->m_string_size } :
+                std::string_view{ text( ), text_size( ) };
+
+            snapshot_header_t header{ };
+            std::memcpy( header.m_magic, snapshot_magic, sizeof( header.m_magic ) );
+            header.m_version = snapshot_version;
+            header.m_node_size = sizeof( kv_flat_node_t );
+            header.m_source = source;
+            header.m_node_count = m_tree->m_node_count;
+            header.m_index_size = m_tree->m_index_size;
+            header.m_string_size = static_cast< u32 >( strings.size( ) );
+
+            fs::path temp = path;
+            temp += fmt::format( ".{:x}{:08x}.tmp", std::chrono::steady_clock::now( ).time_since_epoch( ).count( ), std::random_device{ }( ) );
+
+            {
+                std::ofstream out( temp, std::ios::binary | std::ios::trunc );
+
+                if ( !out.good( ) )
+                    return false;
+
+                out.write( reinterpret_cast< const char* >( &header ), sizeof( header ) );
+                out.write( reinterpret_cast< const char* >( m_tree->m_nodes ), m_tree->m_node_count * sizeof( kv_flat_node_t ) );
+                out.write( reinterpret_cast< const char* >( m_tree->m_index ), m_tree->m_index_size * sizeof( u32 ) );
+                out.write( strings.data( ), strings.size( ) );
+                out.close( );
+
+                if ( out.fail( ) )
+                {
+                    std::error_code ec;
+                    fs::remove( temp, ec );
+                    return false;
+                }
+            }
+
+            std::error_code ec;
+            fs::rename( temp, path, ec );
+
+            if ( ec )
+            {
+                fs::remove( temp, ec );
+                return false;
+            }
+
+            return true;
+        }
+        // Maps a snapshot written by save_snapshot, false if it is missing, damaged or made from another source
+        bool load_snapshot( const fs::path& path, const kv_snapshot_key& source )
+        {
+            kv_stats::timer_t timer{ kv_stats::load };
+
+            m_tree.reset( );
+            m_data.reset( );
+
+            if ( !m_mapping.open( path ) || m_mapping.size( ) < sizeof( snapshot_header_t ) )
+            {
+                m_mapping.close( );
+                return false;
+            }
+
+            snapshot_header_t header;
+            std::memcpy( &header, m_mapping.data( ), sizeof( header ) );
+
+            usize nodes_size = static_cast< usize >( header.m_node_count ) * sizeof( kv_flat_node_t );
+            usize index_size = static_cast< usize >( header.m_index_size ) * sizeof( u32 );
+
+            if ( std::memcmp( header.m_magic, snapshot_magic, sizeof( header.m_magic ) ) != 0 ||
+                header.m_version != snapshot_version ||
+                header.m_node_size != sizeof( kv_flat_node_t ) ||
+                !( header.m_source == source ) ||
+                header.m_node_count == 0 ||
+                sizeof( header ) + nodes_size + index_size + header.m_string_size != m_mapping.size( ) )
+            {
+                m_mapping.close( );
+                return false;
+            }
+
+            const u8* base = m_mapping.data( ) + sizeof( header );
+
+            auto tree = std::make_unique<kv_flat_tree_t>( );
+            tree->m_nodes = reinterpret_cast< const kv_flat_node_t* >( base );
+            tree->m_index = reinterpret_cast< const u32* >( base + nodes_size );
+            tree->m_text = reinterpret_cast< const char* >( base + nodes_size + index_size );
+            tree->m_node_count = header.m_node_count;
+            tree->m_index_size = header.m_index_size;
+            tree->m_string_size = header.m_string_size;
+
+            if ( !is_valid( *tree ) )
+            {
+                m_mapping.close( );
+                return false;
+            }
+
+            m_tree = std::move( tree );
+            return true;
+        }
+
+        // Text the tree points into, the arena strings for frozen files
+        const char* text( ) const
+        {
+            if ( m_tree && m_tree->m_string_size )
+                return m_tree->m_text;
+
+            if ( m_mapping.is_open( ) )
+                return m_mapping.c_str( );
+
+            return m_data ? m_data->c_str( ) : "";
+        }
+
+        // Node count including root
+        usize node_count( ) const
+        {
+            return m_tree ? m_tree->m_node_count : 0;
+        }
+        // Bytes used by the arena, not counting the text
+        usize arena_size( ) const
+        {
+            return m_tree ? m_tree->m_node_count * sizeof( kv_flat_node_t ) + m_tree->m_index_size * sizeof( u32 ) + m_tree->m_string_size : 0;
+        }
+
+    private:
+        // Maps or reads the file into memory
+        bool read( const fs::path& file, load_mode mode )
+        {
+            kv_stats::timer_t timer{ kv_stats::load };
+
+            if ( mode == load_mode::map && m_mapping.open( file ) && m_mapping.null_terminated( ) )
+            {
+                m_data.reset( );
+                return true;
+            }
+
+            m_mapping.close( );
+
+            std::ifstream in( file, std::ios::binary );
+
+            if ( !in.good( ) )
+                return false;
+
+            size_t size = fs::file_size( file );
+
+            m_data = std::make_unique<std::string>( size, '\0' );
+            in.read( m_data->data( ), size );
+            return true;
+        }
+        // Every offset of a snapshot tree is in range and the blocks form the breadth first layout compact makes,
+        // children right after the previous block's children, so a damaged file can't send a lookup outside the
+        // mapping or into a cycle
+        static bool is_valid( const kv_flat_tree_t& tree )
+        {
+            const kv_flat_node_t* nodes = tree.m_nodes;
+            u64 next_child = 1;
+
+            if ( nodes[ 0 ].m_type != key_value::value_type::BLOCK )
+                return false;
+
+            for ( u32 i = 0; i < tree.m_node_count; ++i )
+            {
+                const kv_flat_node_t& node = nodes[ i ];
+
+                if ( static_cast< u64 >( node.m_key ) + node.m_key_size > tree.m_string_size )
+                    return false;
+
+                if ( node.m_type == key_value::value_type::VALUE )
+                {
+                    if ( static_cast< u64 >( node.m_data ) + node.m_size > tree.m_string_size || node.m_index != npos )
+                        return false;
+
+                    continue;
+                }
+
+                if ( node.m_type != key_value::value_type::BLOCK || node.m_data != next_child )
+                    return false;
+
+                next_child += node.m_size;
+
+                if ( next_child > tree.m_node_count )
+                    return false;
+
+                if ( node.m_index == npos )
+                    continue;
+
+                // [ bucket count ][ displacement per bucket ][ child index per slot ], displacements can be anything
+                if ( node.m_size == 0 || static_cast< u64 >( node.m_index ) + 1 > tree.m_index_size )
+                    return false;
+
+                const u32* index = tree.m_index + node.m_index;
+                u32 bucket_count = index[ 0 ];
+
+                if ( bucket_count == 0 || bucket_count > node.m_size ||
+                    static_cast< u64 >( node.m_index ) + 1 + bucket_count + node.m_size > tree.m_index_size )
+                    return false;
+
+                for ( u32 slot = 0; slot < node.m_size; ++slot )
+                {
+                    u32 child = index[ 1 + bucket_count + slot ];
+
+                    if ( child < node.m_data || child - node.m_data >= node.m_size )
+                        return false;
+                }
+            }
+
+            return next_child == tree.m_node_count;
+        }
+        // Size of the parsed text without the terminating '\0'
+        usize text_size( ) const
+        {
+            if ( m_mapping.is_open( ) )
+                return m_mapping.size( );
+
+            return m_data ? m_data->size( ) : 0;
+        }
+
+        // Perfect hash functions, murmur3 finalizer and multiply shift range reduction instead of modulo
+        static u32 mix( u32 h )
+        {
+            h ^= h >> 16;
+            h *= 0x85ebca6b;
+            h ^= h >> 13;
+            h *= 0xc2b2ae35;
+            h ^= h >> 16;
+            return h;
+        }
+        static u32 reduce( u32 h, u32 n )
+        {
+            return static_cast< u32 >( ( static_cast< u64 >( h ) * n ) >> 32 );
+        }
+        static u32 perfect_bucket( u32 hash, u32 buckets )
+        {
+            return reduce( mix( hash ), buckets );
+        }
+        static u32 perfect_slot( u32 hash, u32 displacement, u32 size )
+        {
+            return reduce( mix( hash ^ displacement ), size );
+        }
+
+        // Hash and displace minimal perfect hash over the children hashes, layout is
+        // [ bucket count ][ displacement per bucket ][ child index per slot ]
+        // Fails if two children share a hash, those blocks are searched linearly
+        static bool build_perfect_hash( const kv_flat_node_t* nodes, u32 first, u32 size, std::vector<u32>& index )
+        {
+            std::vector<u32> hashes( size );
+            for ( u32 i = 0; i < size; ++i )
+                hashes[ i ] = nodes[ first + i ].m_hash;
+
+            std::sort( hashes.begin( ), hashes.end( ) );
+            if ( std::adjacent_find( hashes.begin( ), hashes.end( ) ) != hashes.end( ) )
+                return false;
+
+            std::vector<u32> slots( size );
+            std::vector<u32> order;
+            std::vector<u32> placed;
+            std::vector<u8> taken( size );
+
+            // Average bucket size 4, retried with smaller buckets if a bucket can't be placed
+            for ( u32 bucket_size : { 4u, 2u, 1u } )
+            {
+                u32 bucket_count = ( size + bucket_size - 1 ) / bucket_size;
+                std::vector<u32> displacements( bucket_count, 0 );
+                std::vector<std::vector<u32>> buckets( bucket_count );
+
+                for ( u32 i = 0; i < size; ++i )
+                    buckets[ perfect_bucket( nodes[ first + i ].m_hash, bucket_count ) ].push_back( first + i );
+
+                // Biggest buckets first while most slots are free
+                order.resize( bucket_count );
+                for ( u32 b = 0; b < bucket_count; ++b )
+                    order[ b ] = b;
+                std::stable_sort( order.begin( ), order.end( ), [ & ]( u32 a, u32 b ) { return buckets[ a ].size( ) > buckets[ b ].size( ); } );
+
+                std::fill( taken.begin( ), taken.end( ), 0 );
+                bool ok = true;
+
+                for ( u32 b : order )
+                {
+                    if ( buckets[ b ].empty( ) )
+                        break;
+
+                    bool found = false;
+
+                    for ( u32 seed = 1; seed < size * 64 + 1024 && !found; ++seed )
+                    {
+                        u32 displacement = mix( seed );
+                        placed.clear( );
+
+                        for ( u32 c : buckets[ b ] )
+                        {
+                            u32 slot = perfect_slot( nodes[ c ].m_hash, displacement, size );
+
+                            if ( taken[ slot ] )
+                                break;
+
+                            taken[ slot ] = 1;
+                            slots[ slot ] = c;
+                            placed.push_back( slot );
+                        }
+
+                        if ( placed.size( ) == buckets[ b ].size( ) )
+                        {
+                            displacements[ b ] = displacement;
+                            found = true;
+                        }
+                        else
+                        {
+                            for ( u32 slot : placed )
+                                taken[ slot ] = 0;
+                        }
+                    }
+
+                    if ( !found )
+                    {
+                        ok = false;
+                        break;
+                    }
+                }
+
+                if ( !ok )
+                    continue;
+
+                index.push_back( bucket_count );
+                index.insert( index.end( ), displacements.begin( ), displacements.end( ) );
+                index.insert( index.end( ), slots.begin( ), slots.end( ) );
+                return true;
+            }
+
+            return false;
+        }
+
+        // Lay nodes out breadth first so children of every block are consecutive and build hash indexes
+        // strings are copied into the arena and node offsets point into them when text is nullptr
+        void compact( const std::vector<build_node_t>& nodes, const char* text, std::string_view strings = {} )
+        {
+            u32 node_count = static_cast< u32 >( nodes.size( ) );
+
+            // out doubles as the breadth first queue, source maps placed nodes back to the build nodes
+            std::vector<kv_flat_node_t> out( node_count );
+            std::vector<u32> index;
+            out[ 0 ] = kv_flat_node_t{ 0, 0, 0, 0, nodes[ 0 ].m_size, npos, key_value::value_type::BLOCK };
+            u32 placed = 1;
+            std::vector<u32> source( node_count );
+            source[ 0 ] = 0;
+
+            for ( u32 i = 0; i < placed; ++i )
+            {
+                const build_node_t& src = nodes[ source[ i ] ];
+
+                if ( src.m_type != key_value::value_type::BLOCK )
+                    continue;
+
+                out[ i ].m_data = placed;
+
+                for ( u32 c = src.m_first_child; c != npos; c = nodes[ c ].m_next_sibling )
+                {
+                    const build_node_t& child = nodes[ c ];
+                    source[ placed ] = c;
+                    out[ placed++ ] = kv_flat_node_t{ child.m_key, child.m_key_size, child.m_hash, child.m_data, child.m_size, npos, child.m_type };
+                }
+
+                if ( out[ i ].m_size >= index_threshold )
+                {
+                    u32 offset = static_cast< u32 >( index.size( ) );
+
+                    if ( build_perfect_hash( out.data( ), out[ i ].m_data, out[ i ].m_size, index ) )
+                        out[ i ].m_index = offset;
+                }
+            }
+
+            usize nodes_size = node_count * sizeof( kv_flat_node_t );
+            usize index_size = index.size( ) * sizeof( u32 );
+
+            auto tree = std::make_unique<kv_flat_tree_t>( );
+            tree->m_arena = std::make_unique<u8[]>( nodes_size + index_size + strings.size( ) );
+
+            u8* arena = tree->m_arena.get( );
+            std::memcpy( arena, out.data( ), nodes_size );
+            if ( index_size )
+                std::memcpy( arena + nodes_size, index.data( ), index_size );
+            if ( !strings.empty( ) )
+                std::memcpy( arena + nodes_size + index_size, strings.data( ), strings.size( ) );
+
+            tree->m_text = text ? text : reinterpret_cast< const char* >( arena + nodes_size + index_size );
+            tree->m_nodes = reinterpret_cast< const kv_flat_node_t* >( arena );
+            tree->m_index = reinterpret_cast< const u32* >( arena + nodes_size );
+            tree->m_node_count = node_count;
+            tree->m_index_size = static_cast< u32 >( index.size( ) );
+            tree->m_string_size = static_cast< u32 >( strings.size( ) );
+            m_tree = std::move( tree );
+        }
+
+    private:
+        std::unique_ptr<kv_flat_tree_t> m_tree;
+        // On the heap so the text keeps its address when the file moves, a short string would move with it
+        std::unique_ptr<std::string>    m_data;
+        mapped_file                     m_mapping;
+    };
+
+    inline const kv_flat_node_t& kv_node::node( ) const
+    {
+        return m_tree->m_nodes[ m_index ];
+    }
+    inline key_value::value_type kv_node::type( ) const
+    {
+        return node( ).m_type;
+    }
+    inline value_t kv_node::key( ) const
+    {
+        return value_t{ std::string_view{ m_tree->m_text + node( ).m_key, node( ).m_key_size } };
+    }
+    inline value_t kv_node::value( ) const
+    {
+        if ( node( ).m_type != value_type::VALUE )
+            return value_t{ std::string_view{} };
+
+        return value_t{ std::string_view{ m_tree->m_text + node( ).m_data, node( ).m_size } };
+    }
+    inline kv_node kv_node::find( const kv_key& key ) const
+    {
+        const kv_flat_node_t& block = node( );
+
+        if ( block.m_type != value_type::BLOCK )
+            return kv_node{};
+
+        u32 hash = key.m_hash;
+
+        auto matches = [ & ]( u32 idx ) -> bool
+        {
+            const kv_flat_node_t& child = m_tree->m_nodes[ idx ];
+            return child.m_hash == hash &&
+                kv_key::equal( std::string_view{ m_tree->m_text + child.m_key, child.m_key_size }, key );
+        };
+
+        // One probe, the slot holds the only child that can match
+        if ( block.m_index != kv_flat_file::npos )
+        {
+            const u32* index = m_tree->m_index + block.m_index;
+            u32 bucket_count = index[ 0 ];
+            u32 displacement = index[ 1 + kv_flat_file::perfect_bucket( hash, bucket_count ) ];
+            u32 c = index[ 1 + bucket_count + kv_flat_file::perfect_slot( hash, displacement, block.m_size ) ];
+            bool hit = matches( c );
+
+            kv_stats::lookup( hit, nullptr );
+            return hit ? kv_node{ m_tree, c } : kv_node{};
+        }
+
+        for ( u32 c = block.m_data; c < block.m_data + block.m_size; ++c )
+        {
+            if ( matches( c ) )
+            {
+                kv_stats::lookup( true, nullptr );
+                return kv_node{ m_tree, c };
+            }
+        }
+
+        kv_stats::lookup( false, nullptr );
+        return kv_node{};
+    }
+    inline kv_node kv_node::find_recursive( const kv_key& key ) const
+    {
+        // Breadth first so the shallowest match wins
+        std::vector<kv_node> queue{ *this };
+
+        for ( usize i = 0; i < queue.size( ); ++i )
+        {
+            if ( kv_node result = queue[ i ].find( key ); result )
+                return result;
+
+            for ( kv_node child : queue[ i ] )
+            {
+                if ( child.type( ) == value_type::BLOCK )
+                    queue.push_back( child );
+            }
+        }
+
+        return kv_node{};
+    }
+    inline usize kv_node::size( ) const
+    {
+        return node( ).m_type == value_type::BLOCK ? node( ).m_size : 0;
+    }
+    inline kv_node::iterator kv_node::begin( ) const
+    {
+        return iterator{ m_tree, node( ).m_type == value_type::BLOCK ? node( ).m_data : 0 };
+    }
+    inline kv_node::iterator kv_node::end( ) const
+    {
+        return iterator{ m_tree, node( ).m_type == value_type::BLOCK ? node( ).m_data + node( ).m_size : 0 };
+    }
+}
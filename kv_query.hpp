@@ -0,0 +1,399 @@
+#pragma once
+
+#include "kv.hpp"
+
+#include <vector>
+#include <memory>
+#include <type_traits>
+
+namespace valve
+{
+    // Path queries over key_value trees, compiled once and run any number of times
+    //
+    //  items_game/paint_kits/*/description_tag     steps are separated by /
+    //  *                                           any child
+    //  **                                          any number of blocks in between, zero included
+    //  items/*[prefab=weapon_base]/name            only blocks with a child prefab equal to weapon_base
+    //  items/*[item_name]                          only blocks that have an item_name
+    //  "key with/slash"                            quotes for keys and values with special charachters
+    //
+    // Keys compare case insensitive like find, predicate values compare exact
+    // Results come from a lazy iterator, the tree must not change while iterating
+    // With more than one ** a node can be reached through different paths and come up more than once
+    class kv_query
+    {
+        enum class step_type
+        {
+            key,        // child with this key
+            any,        // every child
+            descend     // this block and every block below it
+        };
+
+        struct predicate_t
+        {
+            kv_key           m_key;
+            std::string_view m_value;
+            bool             m_has_value;
+        };
+
+        struct step_t
+        {
+            step_type m_type;
+            kv_key    m_key;
+            u32       m_predicate;      // first predicate in m_predicates
+            u32       m_predicate_count;
+        };
+
+        struct frame_t
+        {
+            key_value*                    m_block;
+            u32                           m_step;
+            bool                          m_started;
+            key_value::kv_map_t::iterator m_it;
+        };
+
+    public:
+        class iterator
+        {
+            friend class kv_query;
+
+        public:
+            key_value& operator*( ) const
+            {
+                return *m_current;
+            }
+            key_value* operator->( ) const
+            {
+                return m_current;
+            }
+            iterator& operator++( ) // prefix
+            {
+                m_current = m_query->next( m_stack );
+                return *this;
+            }
+            bool operator==( const iterator& other ) const
+            {
+                return m_current == other.m_current;
+            }
+            bool operator!=( const iterator& other ) const
+            {
+                return m_current != other.m_current;
+            }
+
+        private:
+            const kv_query*      m_query{ nullptr };
+            std::vector<frame_t> m_stack;
+            key_value*           m_current{ nullptr };
+        };
+
+        struct result_t
+        {
+            iterator begin( ) const
+            {
+                return m_query->begin( *m_root );
+            }
+            iterator end( ) const
+            {
+                return iterator{};
+            }
+
+            const kv_query* m_query;
+            key_value*      m_root;
+        };
+
+        static std::optional<kv_query> compile( std::string_view path )
+        {
+            kv_query query;
+
+            if ( !query.parse( path ) )
+                return std::nullopt;
+
+            return query;
+        }
+
+        // Lazy range over every match below root
+        result_t run( key_value& root ) const
+        {
+            return result_t{ this, &root };
+        }
+        result_t run( kv_file& kvf ) const
+        {
+            return run( kvf.root( ) );
+        }
+        // First match or nullptr
+        key_value* first( key_value& root ) const
+        {
+            iterator it = begin( root );
+            return it.m_current;
+        }
+        key_value* first( kv_file& kvf ) const
+        {
+            return first( kvf.root( ) );
+        }
+
+        // Every match converted to T ( i32 or f32 ) in one contiguous vector, for example all wear_remap_min
+        // with items_game/paint_kits/*/wear_remap_min, blocks and values that aren't numbers give fallback
+        template <typename T>
+        std::vector<T> column( key_value& root, T fallback = T{ } ) const
+        {
+            static_assert( std::is_same_v<T, i32> || std::is_same_v<T, f32>, "column supports i32 and f32" );
+
+            std::vector<T> out;
+
+            for ( key_value& kv : run( root ) )
+            {
+                if ( kv.type( ) != key_value::value_type::VALUE )
+                {
+                    out.push_back( fallback );
+                    continue;
+                }
+
+                if constexpr ( std::is_same_v<T, i32> )
+                    out.push_back( kv.as_int( ).value_or( fallback ) );
+                else
+                    out.push_back( kv.as_float( ).value_or( fallback ) );
+            }
+
+            return out;
+        }
+        template <typename T>
+        std::vector<T> column( kv_file& kvf, T fallback = T{ } ) const
+        {
+            return column<T>( kvf.root( ), fallback );
+        }
+
+        usize step_count( ) const
+        {
+            return m_steps.size( );
+        }
+
+    private:
+        iterator begin( key_value& root ) const
+        {
+            iterator it;
+            it.m_query = this;
+
+            if ( m_steps.empty( ) || root.type( ) != key_value::value_type::BLOCK )
+                return it;
+
+            // Wildcard steps keep a frame each, key steps never stay on the stack
+            it.m_stack.reserve( m_steps.size( ) + 8 );
+            it.m_stack.push_back( frame_t{ &root, 0, false, {} } );
+            it.m_current = next( it.m_stack );
+            return it;
+        }
+
+        // Runs until the next match, nullptr when done
+        key_value* next( std::vector<frame_t>& stack ) const
+        {
+            while ( !stack.empty( ) )
+            {
+                frame_t& frame = stack.back( );
+                const step_t& step = m_steps[ frame.m_step ];
+                bool last = frame.m_step + 1 == m_steps.size( );
+
+                if ( !frame.m_started )
+                {
+                    frame.m_started = true;
+                    frame.m_it = frame.m_block->map( ).begin( );
+
+                    if ( step.m_type == step_type::key )
+                    {
+                        key_value* child = frame.m_block->find( step.m_key );
+                        u32 depth = frame.m_step;
+                        stack.pop_back( );
+
+                        if ( !child || !matches( step, *child ) )
+                            continue;
+
+                        if ( last )
+                            return child;
+
+                        if ( child->type( ) == key_value::value_type::BLOCK )
+                            stack.push_back( frame_t{ child, depth + 1, false, {} } );
+
+                        continue;
+                    }
+
+                    // Zero blocks in between, the rest of the path continues from this block
+                    if ( step.m_type == step_type::descend && !last )
+                    {
+                        stack.push_back( frame_t{ frame.m_block, frame.m_step + 1, false, {} } );
+                        continue;
+                    }
+                }
+
+                if ( frame.m_it == frame.m_block->map( ).end( ) )
+                {
+                    stack.pop_back( );
+                    continue;
+                }
+
+                key_value& child = ( frame.m_it++ )->second;
+                bool is_block = child.type( ) == key_value::value_type::BLOCK;
+                u32 depth = frame.m_step;
+
+                if ( step.m_type == step_type::descend )
+                {
+                    if ( is_block )
+                        stack.push_back( frame_t{ &child, depth, false, {} } );
+
+                    // Trailing ** matches everything below
+                    if ( last )
+                        return &child;
+
+                    continue;
+                }
+
+                if ( !matches( step, child ) )
+                    continue;
+
+                if ( last )
+                    return &child;
+
+                if ( is_block )
+                    stack.push_back( frame_t{ &child, depth + 1, false, {} } );
+            }
+
+            return nullptr;
+        }
+
+        bool matches( const step_t& step, key_value& kv ) const
+        {
+            for ( u32 i = step.m_predicate; i < step.m_predicate + step.m_predicate_count; ++i )
+            {
+                const predicate_t& predicate = m_predicates[ i ];
+                key_value* child = kv.find( predicate.m_key );
+
+                if ( !child )
+                    return false;
+
+                if ( predicate.m_has_value && ( child->type( ) != key_value::value_type::VALUE || child->value( ).as_str_v( ) != predicate.m_value ) )
+                    return false;
+            }
+
+            return true;
+        }
+
+        bool parse( std::string_view path )
+        {
+            // Keys point into m_text so moving the query keeps them valid
+            m_text = std::make_unique<char[]>( path.size( ) + 1 );
+            std::memcpy( m_text.get( ), path.data( ), path.size( ) );
+
+            const char* current = m_text.get( );
+            const char* end = current + path.size( );
+
+            auto fail = [ & ]( [[maybe_unused]] const char* msg ) -> bool
+            {
+#ifdef KV_PRINT_ERRORS
+                fmt::print( "{} at {} in query {}\n", msg, static_cast< usize >( current - m_text.get( ) ), path );
+#endif // KV_PRINT_ERRORS
+                m_steps.clear( );
+                m_predicates.clear( );
+                return false;
+            };
+
+            // Quoted or bare text up to one of the stop charachters
+            auto token = [ & ]( std::string_view stop, std::string_view& out ) -> bool
+            {
+                if ( current < end && *current == '"' )
+                {
+                    const char* start = ++current;
+
+                    while ( current < end && *current != '"' )
+                        ++current;
+
+                    if ( current == end )
+                        return false;
+
+                    out = std::string_view{ start, static_cast< usize >( current++ - start ) };
+                    return true;
+                }
+
+                const char* start = current;
+
+                while ( current < end && stop.find( *current ) == std::string_view::npos )
+                    ++current;
+
+                out = std::string_view{ start, static_cast< usize >( current - start ) };
+                return true;
+            };
+
+            while ( current < end )
+            {
+                std::string_view name;
+                bool quoted = *current == '"';
+
+                if ( !token( "/[", name ) )
+                    return fail( "Unterminated quote" );
+
+                if ( name.empty( ) && !quoted )
+                    return fail( "Empty step" );
+
+                step_t step{ step_type::key, kv_key{ name }, static_cast< u32 >( m_predicates.size( ) ), 0 };
+
+                if ( !quoted && name == "*" )
+                    step.m_type = step_type::any;
+                else if ( !quoted && name == "**" )
+                    step.m_type = step_type::descend;
+
+                while ( current < end && *current == '[' )
+                {
+                    if ( step.m_type == step_type::descend )
+                        return fail( "Predicate on **" );
+
+                    ++current;
+
+                    predicate_t predicate{ {}, {}, false };
+                    std::string_view key;
+
+                    if ( !token( "=]", key ) )
+                        return fail( "Unterminated quote" );
+
+                    if ( key.empty( ) )
+                        return fail( "Empty predicate" );
+
+                    predicate.m_key = kv_key{ key };
+
+                    if ( current < end && *current == '=' )
+                    {
+                        ++current;
+
+                        if ( !token( "]", predicate.m_value ) )
+                            return fail( "Unterminated quote" );
+
+                        predicate.m_has_value = true;
+                    }
+
+                    if ( current == end || *current != ']' )
+                        return fail( "Expected ]" );
+
+                    ++current;
+                    m_predicates.push_back( predicate );
+                    ++step.m_predicate_count;
+                }
+
+                // a/**/**/b is the same as a/**/b but would walk every block twice
+                if ( step.m_type != step_type::descend || m_steps.empty( ) || m_steps.back( ).m_type != step_type::descend )
+                    m_steps.push_back( step );
+
+                if ( current < end )
+                {
+                    if ( *current != '/' )
+                        return fail( "Expected /" );
+
+                    if ( ++current == end )
+                        return fail( "Empty step" );
+                }
+            }
+
+            return true;
+        }
+
+    private:
+        std::unique_ptr<char[]>  m_text;
+        std::vector<step_t>      m_steps;
+        std::vector<predicate_t> m_predicates;
+    };
+}
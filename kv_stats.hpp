@@ -0,0 +1,227 @@
+#pragma once
+
+#include "types.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <memory_resource>
+
+#include <fmt/format.h>
+
+// define KV_STATS to count what kv_file, kv_flat_file and vpk_file do while loading, parsing and looking up
+// Without it every counter call compiles to nothing and snapshot( ) returns zeros
+// Define it for the whole project or not at all, key_value and kv_file change layout with it so mixing
+// translation units built with and without it breaks the one definition rule
+namespace valve
+{
+    class kv_stats
+    {
+    public:
+        enum counter : u32
+        {
+            bytes_scanned,          // Text the reader went over, skipped blocks included
+            nodes_created,
+            max_depth,              // Deepest block a reader opened, counted from where the reader started
+            duplicates_dropped,     // Keys dropped because the first one wins
+            rehashes,               // Maps and tables that grew while building
+            allocations,            // Through kv_stats::default_resource( ) or a counting_resource_t
+            allocated_bytes,
+            lookup_hits,
+            lookup_misses,
+            counter_count
+        };
+
+        enum phase : u32
+        {
+            load,                   // Reading or mapping files
+            parse,
+            flatten,                // csgo::items_game prefabs
+            phase_count
+        };
+
+        // Plain copy of the counters
+        struct snapshot_t
+        {
+            u64 m_counters[ counter_count ]{ };
+            u64 m_phase_ns[ phase_count ]{ };
+            u64 m_phase_calls[ phase_count ]{ };
+
+            u64 operator[]( counter c ) const
+            {
+                return m_counters[ c ];
+            }
+            f64 seconds( phase p ) const
+            {
+                return m_phase_ns[ p ] / 1e9;
+            }
+
+            std::string json( ) const
+            {
+                static constexpr const char* counter_names[ counter_count ] = {
+                    "bytes_scanned", "nodes_created", "max_depth", "duplicates_dropped", "rehashes",
+                    "allocations", "allocated_bytes", "lookup_hits", "lookup_misses"
+                };
+                static constexpr const char* phase_names[ phase_count ] = { "load", "parse", "flatten" };
+
+                std::string out = fmt::format( "{{ \"enabled\": {}", enabled );
+
+                for ( u32 i = 0; i < counter_count; ++i )
+                    out += fmt::format( ", \"{}\": {}", counter_names[ i ], m_counters[ i ] );
+
+                out += ", \"phases\": { ";
+
+                for ( u32 i = 0; i < phase_count; ++i )
+                    out += fmt::format( "{}\"{}\": {{ \"seconds\": {:.6f}, \"calls\": {} }}", i ? ", " : "", phase_names[ i ], m_phase_ns[ i ] / 1e9, m_phase_calls[ i ] );
+
+                out += " } }";
+                return out;
+            }
+        };
+
+        // Lookup counters of one kv_file
+        struct lookups_t
+        {
+            u64 m_hits{ 0 };
+            u64 m_misses{ 0 };
+        };
+        struct lookup_counters_t
+        {
+            std::atomic<u64> m_hits{ 0 };
+            std::atomic<u64> m_misses{ 0 };
+        };
+
+#ifdef KV_STATS
+        static constexpr bool enabled = true;
+#else
+        static constexpr bool enabled = false;
+#endif
+
+        static void add( [[maybe_unused]] counter c, [[maybe_unused]] u64 value = 1 )
+        {
+#ifdef KV_STATS
+            s_counters[ c ].fetch_add( value, std::memory_order_relaxed );
+#endif
+        }
+        static void max( [[maybe_unused]] counter c, [[maybe_unused]] u64 value )
+        {
+#ifdef KV_STATS
+            u64 current = s_counters[ c ].load( std::memory_order_relaxed );
+            while ( current < value && !s_counters[ c ].compare_exchange_weak( current, value, std::memory_order_relaxed ) ) {}
+#endif
+        }
+        static void lookup( [[maybe_unused]] bool hit, [[maybe_unused]] lookup_counters_t* file )
+        {
+#ifdef KV_STATS
+            add( hit ? lookup_hits : lookup_misses );
+
+            if ( file )
+                ( hit ? file->m_hits : file->m_misses ).fetch_add( 1, std::memory_order_relaxed );
+#endif
+        }
+
+        static snapshot_t snapshot( )
+        {
+            snapshot_t out;
+#ifdef KV_STATS
+            for ( u32 i = 0; i < counter_count; ++i )
+                out.m_counters[ i ] = s_counters[ i ].load( std::memory_order_relaxed );
+
+            for ( u32 i = 0; i < phase_count; ++i )
+            {
+                out.m_phase_ns[ i ] = s_phase_ns[ i ].load( std::memory_order_relaxed );
+                out.m_phase_calls[ i ] = s_phase_calls[ i ].load( std::memory_order_relaxed );
+            }
+#endif
+            return out;
+        }
+        static std::string json( )
+        {
+            return snapshot( ).json( );
+        }
+        static void reset( )
+        {
+#ifdef KV_STATS
+            for ( auto& c : s_counters )
+                c.store( 0, std::memory_order_relaxed );
+
+            for ( u32 i = 0; i < phase_count; ++i )
+            {
+                s_phase_ns[ i ].store( 0, std::memory_order_relaxed );
+                s_phase_calls[ i ].store( 0, std::memory_order_relaxed );
+            }
+#endif
+        }
+
+        // Adds the time until it goes out of scope to a phase
+        class timer_t
+        {
+        public:
+            timer_t( [[maybe_unused]] phase p )
+#ifdef KV_STATS
+                : m_phase{ p }, m_start{ std::chrono::steady_clock::now( ) }
+#endif
+            {}
+            timer_t( const timer_t& ) = delete;
+            timer_t& operator=( const timer_t& ) = delete;
+            ~timer_t( )
+            {
+#ifdef KV_STATS
+                auto elapsed = std::chrono::duration_cast< std::chrono::nanoseconds >( std::chrono::steady_clock::now( ) - m_start );
+                s_phase_ns[ m_phase ].fetch_add( static_cast< u64 >( elapsed.count( ) ), std::memory_order_relaxed );
+                s_phase_calls[ m_phase ].fetch_add( 1, std::memory_order_relaxed );
+#endif
+            }
+
+#ifdef KV_STATS
+        private:
+            phase                                 m_phase;
+            std::chrono::steady_clock::time_point m_start;
+#endif
+        };
+
+        // Counts allocations and passes them on to upstream
+        class counting_resource_t : public std::pmr::memory_resource
+        {
+        public:
+            counting_resource_t( std::pmr::memory_resource* upstream = std::pmr::get_default_resource( ) ) : m_upstream{ upstream } {}
+
+        private:
+            void* do_allocate( std::size_t bytes, std::size_t alignment ) override
+            {
+                add( allocations );
+                add( allocated_bytes, bytes );
+                return m_upstream->allocate( bytes, alignment );
+            }
+            void do_deallocate( void* ptr, std::size_t bytes, std::size_t alignment ) override
+            {
+                m_upstream->deallocate( ptr, bytes, alignment );
+            }
+            bool do_is_equal( const std::pmr::memory_resource& other ) const noexcept override
+            {
+                return this == &other;
+            }
+
+        private:
+            std::pmr::memory_resource* m_upstream;
+        };
+
+        // Resource files use when none is passed, counts allocations when KV_STATS is defined
+        static std::pmr::memory_resource* default_resource( )
+        {
+#ifdef KV_STATS
+            static counting_resource_t resource{ std::pmr::get_default_resource( ) };
+            return &resource;
+#else
+            return std::pmr::get_default_resource( );
+#endif
+        }
+
+#ifdef KV_STATS
+    private:
+        static inline std::atomic<u64> s_counters[ counter_count ]{ };
+        static inline std::atomic<u64> s_phase_ns[ phase_count ]{ };
+        static inline std::atomic<u64> s_phase_calls[ phase_count ]{ };
+#endif
+    };
+}
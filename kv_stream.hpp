@@ -0,0 +1,373 @@
+#pragma once
+
+#include "kv.hpp"
+
+#include <vector>
+#include <istream>
+#include <cerrno>
+
+#ifdef _WIN32
+    #include <io.h>
+#else
+    #include <unistd.h>
+#endif
+
+namespace valve
+{
+    // kv_reader over a std::istream or file descriptor, text is read in fixed size chunks so memory use
+    // only depends on chunk size and the longest key value pair, not the document size
+    // Events are the same as kv_reader but string_views are only valid inside the callback
+    class kv_stream_reader
+    {
+        using parser_t = kv_reader::parser_t;
+
+        enum class state_t
+        {
+            key,        // Expecting key, comment or block end
+            after_key,  // Expecting value or block start
+            line,       // Skipping rest of the line
+            skip        // Skipping a block
+        };
+
+        // Extra bytes after the data so aligned scanner loads stay inside the buffer
+        static constexpr usize padding = 64;
+
+    public:
+        static constexpr usize default_chunk_size = 64 * 1024;
+
+        kv_stream_reader( std::istream& in, usize chunk_size = default_chunk_size ) :
+            m_stream{ &in },
+            m_chunk_size{ chunk_size }
+        {}
+        kv_stream_reader( int fd, usize chunk_size = default_chunk_size ) :
+            m_fd{ fd },
+            m_chunk_size{ chunk_size }
+        {}
+
+        // Returns false on syntax or read error, stopping from a callback is not an error
+        // Parsing ends at the end of the stream, a closing brace that has no block open is an error
+        template <typename V>
+        bool parse( V& visitor )
+        {
+            if ( m_buffer.empty( ) )
+            {
+                m_buffer.resize( m_chunk_size + padding );
+                m_end = m_buffer.data( );
+                *m_end = '\0';
+                m_parser = parser_t{ m_buffer.data( ) };
+            }
+
+            while ( true )
+            {
+                switch ( m_state )
+                {
+                case state_t::key:
+                {
+                    m_parser.skip_whitespace( );
+                    m_parser.reset_start( );
+
+                    if ( m_parser.is_end( ) )
+                    {
+                        if ( !at_window_end( ) || !fill( m_parser.m_current ) )
+                            return end_of_input( );
+                        continue;
+                    }
+
+                    char c = m_parser.peek( );
+
+                    // Value or Block
+                    if ( c == '"' )
+                    {
+                        if ( !string( ) )
+                        {
+                            if ( !at_window_end( ) || !fill( m_parser.m_start ) )
+                                return unterminated_string( );
+                            m_parser.m_current = m_parser.m_start;
+                            continue;
+                        }
+
+                        m_key = static_cast< usize >( m_parser.m_start - m_buffer.data( ) );
+                        m_key_size = static_cast< usize >( m_parser.m_current - m_parser.m_start );
+                        m_state = state_t::after_key;
+                        continue;
+                    }
+
+                    // Skip comments
+                    else if ( c == '/' )
+                    {
+                        if ( m_parser.m_current + 1 == m_end && fill( m_parser.m_current ) )
+                            continue;
+
+                        if ( m_parser.peek_next( ) == '/' )
+                        {
+                            m_line_state = state_t::key;
+                            m_state = state_t::line;
+                            continue;
+                        }
+                    }
+
+                    // Block end, one without an open block is an error
+                    else if ( c == '}' && m_depth )
+                    {
+                        m_parser.advance( );
+                        --m_depth;
+
+                        if ( visitor.block_end( ) == kv_action::stop )
+                            return m_stopped = true;
+
+                        continue;
+                    }
+
+                    // Error
+#ifdef KV_PRINT_ERRORS
+                    fmt::print( "Unexpected charachter on line {}\n", m_parser.m_line );
+#endif // KV_PRINT_ERRORS
+                    return false;
+                }
+                case state_t::after_key:
+                {
+                    m_parser.skip_whitespace( );
+                    m_parser.reset_start( );
+
+                    // Keep the key around while reading more
+                    if ( m_parser.is_end( ) && at_window_end( ) && fill( m_buffer.data( ) + m_key ) )
+                        continue;
+
+                    std::string_view key{ m_buffer.data( ) + m_key + 1, m_key_size - 2 };
+
+                    // value
+                    if ( m_parser.peek( ) == '"' )
+                    {
+                        if ( !string( ) )
+                        {
+                            if ( !at_window_end( ) || !fill( m_buffer.data( ) + m_key ) )
+                                return unterminated_string( );
+                            m_parser.m_current = m_parser.m_start;
+                            continue;
+                        }
+
+                        std::string_view value{ m_parser.m_start + 1, static_cast< usize >( m_parser.m_current - m_parser.m_start ) - 2 };
+
+                        // Conditionals not supported [$PS3], [$XBOX360], [$WIN32] so skip them
+                        m_line_state = state_t::key;
+                        m_state = state_t::line;
+
+                        if ( visitor.value( key, value ) == kv_action::stop )
+                            return m_stopped = true;
+                    }
+
+                    // block
+                    else if ( m_parser.peek( ) == '{' )
+                    {
+                        // consume {
+                        m_parser.advance( );
+
+                        kv_action action = visitor.block_begin( key );
+
+                        if ( action == kv_action::stop )
+                            return m_stopped = true;
+
+                        if ( action == kv_action::skip )
+                        {
+                            m_skip_depth = 1;
+                            m_state = state_t::skip;
+                        }
+                        else
+                        {
+                            ++m_depth;
+                            m_state = state_t::key;
+                        }
+                    }
+
+                    // Key without value is dropped
+                    else
+                        m_state = state_t::key;
+
+                    continue;
+                }
+                case state_t::line:
+                {
+                    m_parser.skip_line( );
+
+                    if ( m_parser.is_end( ) )
+                    {
+                        if ( !at_window_end( ) || !fill( m_parser.m_current ) )
+                            return end_of_input( );
+                        continue;
+                    }
+
+                    m_state = m_line_state;
+                    continue;
+                }
+                case state_t::skip:
+                {
+                    m_parser.skip_to_structural( );
+                    m_parser.reset_start( );
+
+                    switch ( m_parser.peek( ) )
+                    {
+                    case '\0':
+                        if ( !at_window_end( ) || !fill( m_parser.m_current ) )
+                            return end_of_input( );
+                        break;
+                    case '"':
+                        if ( !string( ) )
+                        {
+                            if ( !at_window_end( ) || !fill( m_parser.m_start ) )
+                                return unterminated_string( );
+                            m_parser.m_current = m_parser.m_start;
+                        }
+                        break;
+                    case '{':
+                        m_parser.advance( );
+                        ++m_skip_depth;
+                        break;
+                    case '}':
+                        m_parser.advance( );
+                        if ( !--m_skip_depth )
+                            m_state = state_t::key;
+                        break;
+                    default:
+                        if ( m_parser.m_current + 1 == m_end && fill( m_parser.m_current ) )
+                            break;
+
+                        if ( m_parser.peek_next( ) == '/' )
+                        {
+                            m_line_state = state_t::skip;
+                            m_state = state_t::line;
+                        }
+                        else
+                            m_parser.advance( );
+                        break;
+                    }
+                    continue;
+                }
+                }
+            }
+        }
+
+        // Current line, for error reporting
+        u32 line( ) const
+        {
+            return m_parser.m_line;
+        }
+        // Blocks currently open
+        u32 depth( ) const
+        {
+            return m_depth;
+        }
+        // Parsing was stopped by the visitor
+        bool stopped( ) const
+        {
+            return m_stopped;
+        }
+        // Current buffer size, chunk size plus the longest token that crossed a chunk boundary
+        usize buffer_size( ) const
+        {
+            return m_buffer.size( );
+        }
+
+    private:
+        bool string( )
+        {
+            return m_parser.string_end( );
+        }
+        bool at_window_end( ) const
+        {
+            return m_parser.m_current == m_end;
+        }
+        bool end_of_input( )
+        {
+            if ( m_error )
+                fmt::print( "Read error on line {}!\n", m_parser.m_line );
+            return !m_error;
+        }
+        bool unterminated_string( )
+        {
+            if ( m_error )
+                return end_of_input( );
+            fmt::print( "Unterminated string on line {}!\n", m_parser.m_line );
+            return false;
+        }
+
+        // Sets m_error when reading fails, an interrupted read is retried
+        usize read_some( char* dst, usize size )
+        {
+            if ( m_stream )
+            {
+                m_stream->read( dst, static_cast< std::streamsize >( size ) );
+                m_error = m_stream->bad( );
+                return m_error ? 0 : static_cast< usize >( m_stream->gcount( ) );
+            }
+
+#ifdef _WIN32
+            int result;
+            do
+                result = _read( m_fd, dst, static_cast< unsigned >( size ) );
+            while ( result < 0 && errno == EINTR );
+#else
+            isize result;
+            do
+                result = ::read( m_fd, dst, size );
+            while ( result < 0 && errno == EINTR );
+#endif
+            m_error = result < 0;
+            return result > 0 ? static_cast< usize >( result ) : 0;
+        }
+
+        // Drops everything before keep and reads the next chunk after the data, false at the end of input
+        bool fill( const char* keep )
+        {
+            if ( m_eof )
+                return false;
+
+            char* base = m_buffer.data( );
+            usize kept = static_cast< usize >( m_end - keep );
+            usize shift = static_cast< usize >( keep - base );
+
+            std::memmove( base, keep, kept );
+
+            // Token longer than the buffer
+            if ( kept + m_chunk_size + padding > m_buffer.size( ) )
+            {
+                m_buffer.resize( kept + m_chunk_size + padding );
+                base = m_buffer.data( );
+            }
+
+            // Rebase parser and key on the new buffer, anything in front of keep is gone
+            usize start = m_parser.m_start < keep ? 0 : static_cast< usize >( m_parser.m_start - keep );
+            usize current = static_cast< usize >( m_parser.m_current - keep );
+            m_key = m_key < shift ? 0 : m_key - shift;
+
+            usize read = read_some( base + kept, m_chunk_size );
+            m_eof = !read;
+            m_end = base + kept + read;
+            *m_end = '\0';
+
+            u32 line = m_parser.m_line;
+            m_parser = parser_t{ base };
+            m_parser.m_start = base + start;
+            m_parser.m_current = base + current;
+            m_parser.m_line = line;
+
+            return read;
+        }
+
+    private:
+        std::istream*     m_stream{ nullptr };
+        int               m_fd{ -1 };
+        usize             m_chunk_size;
+        std::vector<char> m_buffer;
+        char*             m_end{ nullptr };
+        bool              m_eof{ false };
+        bool              m_error{ false };
+        parser_t          m_parser{ nullptr };
+        state_t           m_state{ state_t::key };
+        state_t           m_line_state{ state_t::key };
+        usize             m_key{ 0 };
+        usize             m_key_size{ 0 };
+        u32               m_depth{ 0 };
+        u32               m_skip_depth{ 0 };
+        bool              m_stopped{ false };
+    };
+}
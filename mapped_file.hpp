@@ -0,0 +1,204 @@
+#pragma once
+
+#include "types.hpp"
+
+#include <string_view>
+#include <filesystem>
+
+#ifdef _WIN32
+    #ifndef WIN32_LEAN_AND_MEAN
+        #define WIN32_LEAN_AND_MEAN
+    #endif
+    #ifndef NOMINMAX
+        #define NOMINMAX
+    #endif
+    #include <windows.h>
+#else
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <fcntl.h>
+    #include <unistd.h>
+#endif
+
+namespace valve
+{
+    namespace fs = std::filesystem;
+
+    // How files are brought into memory
+    enum class load_mode
+    {
+        read,   // Copy the file into an owned buffer
+        map     // Map the file read only and use it in place, pages are shared between processes
+    };
+
+    // Read only memory mapping of a whole file
+    class mapped_file
+    {
+    public:
+        mapped_file( ) = default;
+        mapped_file( const mapped_file& ) = delete;
+        mapped_file& operator=( const mapped_file& ) = delete;
+        mapped_file( mapped_file&& other ) noexcept
+        {
+            swap( other );
+        }
+        mapped_file& operator=( mapped_file&& other ) noexcept
+        {
+            if ( this != &other )
+            {
+                close( );
+                swap( other );
+            }
+            return *this;
+        }
+        ~mapped_file( )
+        {
+            close( );
+        }
+
+        bool open( const fs::path& file )
+        {
+            close( );
+
+#ifdef _WIN32
+            HANDLE handle = CreateFileW( file.c_str( ), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr );
+
+            if ( handle == INVALID_HANDLE_VALUE )
+                return false;
+
+            LARGE_INTEGER size{};
+            if ( !GetFileSizeEx( handle, &size ) )
+            {
+                CloseHandle( handle );
+                return false;
+            }
+
+            m_size = static_cast< usize >( size.QuadPart );
+
+            // Empty files can't be mapped
+            if ( !m_size )
+            {
+                CloseHandle( handle );
+                m_open = true;
+                return true;
+            }
+
+            HANDLE mapping = CreateFileMappingW( handle, nullptr, PAGE_READONLY, 0, 0, nullptr );
+            CloseHandle( handle );
+
+            if ( !mapping )
+                return false;
+
+            m_data = static_cast< const u8* >( MapViewOfFile( mapping, FILE_MAP_READ, 0, 0, 0 ) );
+            CloseHandle( mapping );
+
+            if ( !m_data )
+            {
+                m_size = 0;
+                return false;
+            }
+#else
+            int fd = ::open( file.c_str( ), O_RDONLY | O_CLOEXEC );
+
+            if ( fd < 0 )
+                return false;
+
+            struct stat st{};
+            if ( fstat( fd, &st ) != 0 )
+            {
+                ::close( fd );
+                return false;
+            }
+
+            m_size = static_cast< usize >( st.st_size );
+
+            // Empty files can't be mapped
+            if ( !m_size )
+            {
+                ::close( fd );
+                m_open = true;
+                return true;
+            }
+
+            void* data = mmap( nullptr, m_size, PROT_READ, MAP_SHARED, fd, 0 );
+            ::close( fd );
+
+            if ( data == MAP_FAILED )
+            {
+                m_size = 0;
+                return false;
+            }
+
+            m_data = static_cast< const u8* >( data );
+#endif
+            m_open = true;
+            return true;
+        }
+        void close( )
+        {
+            if ( m_data )
+            {
+#ifdef _WIN32
+                UnmapViewOfFile( m_data );
+#else
+                munmap( const_cast< u8* >( m_data ), m_size );
+#endif
+            }
+
+            m_data = nullptr;
+            m_size = 0;
+            m_open = false;
+        }
+
+        bool is_open( ) const
+        {
+            return m_open;
+        }
+        const u8* data( ) const
+        {
+            return m_data;
+        }
+        usize size( ) const
+        {
+            return m_size;
+        }
+        std::string_view as_str_v( ) const
+        {
+            return std::string_view{ reinterpret_cast< const char* >( m_data ), m_size };
+        }
+        // Mapping as c string, the rest of the last page after the file is zero filled so text parsers
+        // can rely on a terminating '\0' unless the file ends exactly on a page boundary
+        const char* c_str( ) const
+        {
+            return m_data ? reinterpret_cast< const char* >( m_data ) : "";
+        }
+        bool null_terminated( ) const
+        {
+            return m_open && ( !m_size || m_size % page_size( ) != 0 );
+        }
+
+        static usize page_size( )
+        {
+#ifdef _WIN32
+            SYSTEM_INFO info{};
+            GetSystemInfo( &info );
+            return info.dwPageSize;
+#else
+            return static_cast< usize >( sysconf( _SC_PAGESIZE ) );
+#endif
+        }
+
+    private:
+        void swap( mapped_file& other )
+        {
+            std::swap( m_data, other.m_data );
+            std::swap( m_size, other.m_size );
+            std::swap( m_open, other.m_open );
+        }
+
+    private:
+        const u8* m_data{ nullptr };
+        usize     m_size{ 0 };
+        bool      m_open{ false };
+    };
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include "types.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+namespace valve
+{
+    // Worker count to use, 0 means one per hardware thread
+    inline u32 thread_count( u32 threads )
+    {
+        if ( !threads )
+            threads = std::thread::hardware_concurrency( );
+
+        return std::max( threads, 1u );
+    }
+
+    // Calls fn( i ) for every i in [0, count) on up to threads threads including the caller and waits for all of them
+    // Indices are handed out in order so earlier items start first, fn must not throw
+    template <typename F>
+    void parallel_for( usize count, F&& fn, u32 threads = 0 )
+    {
+        usize workers = std::min<usize>( thread_count( threads ), count );
+
+        if ( workers <= 1 )
+        {
+            for ( usize i = 0; i < count; ++i )
+                fn( i );
+            return;
+        }
+
+        std::atomic<usize> next{ 0 };
+
+        auto work = [ & ]( )
+        {
+            for ( usize i = next.fetch_add( 1, std::memory_order_relaxed ); i < count; i = next.fetch_add( 1, std::memory_order_relaxed ) )
+                fn( i );
+        };
+
+        std::vector<std::thread> pool;
+        pool.reserve( workers - 1 );
+
+        for ( usize i = 1; i < workers; ++i )
+            pool.emplace_back( work );
+
+        work( );
+
+        for ( std::thread& t : pool )
+            t.join( );
+    }
+}
@@ -1,6 +1,8 @@
 #pragma once
 
 #include "types.hpp"
+#include "kv_stats.hpp"
+#include "mapped_file.hpp"
 
 #include <vector>
 #include <string_view>
@@ -8,6 +10,12 @@
 #include <filesystem>
 #include <unordered_map>
 #include <optional>
+#include <cstring>
+#include <cerrno>
+#include <atomic>
+#include <memory>
+#include <algorithm>
+#include <mutex>
 
 #include <fmt/format.h>
 #include <fmt/compile.h>
@@ -54,15 +62,240 @@ namespace valve
         usize m_size = 0;
     };
 
+    // Archives of one vpk, each opened on first use and kept open until the vpk_file goes away
+    // Reads are positional so any number of threads can read the same archive at once
+    class vpk_archive_cache
+    {
+    public:
+#ifdef _WIN32
+        using handle_t = HANDLE;
+        static inline const handle_t invalid_handle = INVALID_HANDLE_VALUE;
+#else
+        using handle_t = int;
+        static constexpr handle_t invalid_handle = -1;
+#endif
+        // Archive index of data stored in the directory file after the tree
+        static constexpr u32 dir_index = 0x7fff;
+
+        // dir_data is the directory file as loaded, dir_data_offset is where data with dir_index starts in it
+        vpk_archive_cache( std::string pak_path, const u8* dir_data, u64 dir_data_offset )
+            : m_pak_path( std::move( pak_path ) ), m_dir_data( dir_data ), m_dir_data_offset( dir_data_offset ) {}
+        vpk_archive_cache( const vpk_archive_cache& ) = delete;
+        vpk_archive_cache& operator=( const vpk_archive_cache& ) = delete;
+        ~vpk_archive_cache( )
+        {
+            for ( usize i = 0; i <= m_archive_count && m_handles; ++i )
+            {
+                if ( handle_t handle = m_handles[ i ].load( std::memory_order_relaxed ); handle != invalid_handle )
+                    close_file( handle );
+            }
+        }
+
+        const std::string& pak_path( ) const
+        {
+            return m_pak_path;
+        }
+        usize archive_count( ) const
+        {
+            return m_archive_count;
+        }
+
+        // pak01_003.vpk for index 3 of pak01_dir.vpk
+        fs::path archive_path( u32 index ) const
+        {
+            if ( index == dir_index )
+                return fs::u8path( m_pak_path );
+
+            std::string_view archive_path = std::string_view{ m_pak_path }.substr( 0, m_pak_path.find_last_of( '.' ) - 3 );
+            return fs::u8path( fmt::format( FMT_COMPILE( "{}{:03}.vpk" ), archive_path, index ) );
+        }
+
+        // False if the archive can't be opened or ends before offset + size
+        bool read( u32 index, u64 offset, u8* out, usize size ) const
+        {
+            handle_t handle = open( index );
+
+            if ( handle == invalid_handle )
+                return false;
+
+            if ( index == dir_index )
+                offset += m_dir_data_offset;
+
+            while ( size )
+            {
+#ifdef _WIN32
+                OVERLAPPED overlapped{};
+                overlapped.Offset = static_cast< DWORD >( offset );
+                overlapped.OffsetHigh = static_cast< DWORD >( offset >> 32 );
+
+                DWORD chunk = static_cast< DWORD >( std::min<usize>( size, 1u << 30 ) );
+                DWORD done = 0;
+
+                if ( !ReadFile( handle, out, chunk, &done, &overlapped ) || !done )
+                    return false;
+#else
+                ssize_t done = ::pread( handle, out, size, static_cast< off_t >( offset ) );
+
+                if ( done < 0 && errno == EINTR )
+                    continue;
+
+                if ( done <= 0 )
+                    return false;
+#endif
+                out += done;
+                offset += done;
+                size -= done;
+            }
+
+            return true;
+        }
+
+        // Maps an archive on first use, the mapping stays alive as long as anything holds it
+        std::shared_ptr<const mapped_file> map( u32 index ) const
+        {
+            usize slot = index == dir_index ? m_archive_count : index;
+
+            if ( slot > m_archive_count )
+                return nullptr;
+
+            std::lock_guard<std::mutex> lock( m_mappings_mutex );
+
+            if ( !m_mappings[ slot ] )
+            {
+                auto mapping = std::make_shared<mapped_file>( );
+
+                if ( !mapping->open( archive_path( index ) ) )
+                    return nullptr;
+
+                m_mappings[ slot ] = std::move( mapping );
+            }
+
+            return m_mappings[ slot ];
+        }
+
+        // Where preload bytes of an entry start in the directory file
+        u64 dir_offset( const u8* preload ) const
+        {
+            return static_cast< u64 >( preload - m_dir_data );
+        }
+        u64 dir_data_offset( ) const
+        {
+            return m_dir_data_offset;
+        }
+
+    private:
+        friend class vpk_file;
+
+        // Called once by vpk_file after the tree is parsed, before any read
+        void set_archive_count( usize count )
+        {
+            // One more slot for the directory file
+            m_archive_count = count;
+            m_handles = std::make_unique<std::atomic<handle_t>[]>( count + 1 );
+            m_mappings.resize( count + 1 );
+
+            for ( usize i = 0; i <= count; ++i )
+                m_handles[ i ].store( invalid_handle, std::memory_order_relaxed );
+        }
+
+        handle_t open( u32 index ) const
+        {
+            usize slot = index == dir_index ? m_archive_count : index;
+
+            if ( slot > m_archive_count )
+                return invalid_handle;
+
+            handle_t handle = m_handles[ slot ].load( std::memory_order_acquire );
+
+            if ( handle != invalid_handle )
+                return handle;
+
+            // Failed opens aren't cached, the archive may show up later
+            handle_t opened = open_file( archive_path( index ) );
+
+            if ( opened == invalid_handle )
+                return invalid_handle;
+
+            // Another thread opened it first
+            if ( !m_handles[ slot ].compare_exchange_strong( handle, opened, std::memory_order_acq_rel ) )
+            {
+                close_file( opened );
+                return handle;
+            }
+
+            return opened;
+        }
+
+        static handle_t open_file( const fs::path& file )
+        {
+#ifdef _WIN32
+            return CreateFileW( file.c_str( ), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr );
+#else
+            return ::open( file.c_str( ), O_RDONLY | O_CLOEXEC );
+#endif
+        }
+        static void close_file( handle_t handle )
+        {
+#ifdef _WIN32
+            CloseHandle( handle );
+#else
+            ::close( handle );
+#endif
+        }
+
+    private:
+        std::string                                             m_pak_path;
+        const u8*                                               m_dir_data;
+        u64                                                     m_dir_data_offset;
+        usize                                                   m_archive_count{ 0 };
+        std::unique_ptr<std::atomic<handle_t>[]>                m_handles;
+        mutable std::mutex                                      m_mappings_mutex;
+        mutable std::vector<std::shared_ptr<const mapped_file>> m_mappings;
+    };
+
+    // Read only content of an entry, either a view into a mapped archive that the handle keeps mapped
+    // or, when preload and archive bytes had to be joined, its own copy
+    class vpk_data_t
+    {
+    public:
+        vpk_data_t( ) = default;
+        vpk_data_t( const vpk_data_t& ) = delete;
+        vpk_data_t& operator=( const vpk_data_t& ) = delete;
+        vpk_data_t( vpk_data_t&& ) = default;
+        vpk_data_t& operator=( vpk_data_t&& ) = default;
+
+        const u8* data( ) const { return m_data; }
+        usize size( ) const { return m_size; }
+        bool empty( ) const { return !m_size; }
+        const u8* begin( ) const { return m_data; }
+        const u8* end( ) const { return m_data + m_size; }
+
+        // Not null terminated
+        std::string_view as_str_v( ) const { return std::string_view{ reinterpret_cast< const char* >( m_data ), m_size }; }
+
+        // False when the content was copied
+        bool is_mapped( ) const { return m_mapping != nullptr; }
+
+    private:
+        friend struct vpk_entry_t;
+
+        std::shared_ptr<const mapped_file> m_mapping;
+        std::vector<u8>                    m_copy;
+        const u8*                          m_data{ nullptr };
+        usize                              m_size{ 0 };
+    };
+
     struct vpk_entry_t
     {
-        std::string_view m_pak_path;
-        std::string_view m_filename;
-        u32              m_archive_index;
-        u32              m_data_offset;
-        u32              m_data_size;
-        buffer_view<u8>  m_preload_bytes;
-        bool             m_preload_fullfile;
+        std::string_view         m_pak_path;
+        std::string_view         m_filename;
+        u32                      m_archive_index;
+        u32                      m_data_offset;
+        u32                      m_data_size;
+        u32                      m_crc;                    // CRC-32 of the whole content, preload bytes included
+        buffer_view<u8>          m_preload_bytes;
+        bool                     m_preload_fullfile;
+        const vpk_archive_cache* m_archives{ nullptr };    // Owned by the vpk_file
 
         std::optional<std::vector<u8>> get_data( ) const
         {
@@ -70,23 +303,61 @@ namespace valve
 
             if ( m_preload_fullfile )
                 return std::make_optional( std::move( buffer ) );
-            
-            std::string_view archive_path = m_pak_path.substr( 0, m_pak_path.find_last_of( '.' ) - 3 );
-            fs::path p = fs::u8path( fmt::format( FMT_COMPILE("{}{:03}.vpk"), archive_path, m_archive_index ) );
-
-            std::ifstream in( p, std::ios::binary );
 
-            if ( !in.good( ) )
+            if ( !m_archives )
                 return std::nullopt;
-            
+
             size_t old_size = buffer.size( );
             buffer.resize( old_size + m_data_size );
 
-            in.seekg( m_data_offset );
-            in.read( ( char* )( buffer.data( ) + old_size ), m_data_size );
+            if ( !m_archives->read( m_archive_index, m_data_offset, buffer.data( ) + old_size, m_data_size ) )
+                return std::nullopt;
 
             return std::make_optional( std::move( buffer ) );
         }
+
+        // Like get_data without the copy, entries stored whole in the directory file or whole in an archive
+        // are viewed in place, only entries split between preload bytes and an archive are copied
+        std::optional<vpk_data_t> map_data( ) const
+        {
+            vpk_data_t out;
+
+            if ( !m_archives )
+                return std::nullopt;
+
+            if ( m_preload_fullfile || m_preload_bytes.empty( ) )
+            {
+                u32 index = m_preload_fullfile ? vpk_archive_cache::dir_index : m_archive_index;
+                u64 offset = m_preload_fullfile ? m_archives->dir_offset( m_preload_bytes.data( ) ) : m_data_offset;
+                usize size = m_preload_fullfile ? m_preload_bytes.size( ) : m_data_size;
+
+                if ( !size )
+                    return std::make_optional( std::move( out ) );
+
+                // Preload bytes are offset from the start of the directory file, archive data of dir_index from the end of the tree
+                if ( !m_preload_fullfile && index == vpk_archive_cache::dir_index )
+                    offset += m_archives->dir_data_offset( );
+
+                out.m_mapping = m_archives->map( index );
+
+                if ( !out.m_mapping || offset + size > out.m_mapping->size( ) )
+                    return std::nullopt;
+
+                out.m_data = out.m_mapping->data( ) + offset;
+                out.m_size = size;
+                return std::make_optional( std::move( out ) );
+            }
+
+            out.m_copy.resize( m_preload_bytes.size( ) + m_data_size );
+            std::copy( m_preload_bytes.begin( ), m_preload_bytes.end( ), out.m_copy.begin( ) );
+
+            if ( !m_archives->read( m_archive_index, m_data_offset, out.m_copy.data( ) + m_preload_bytes.size( ), m_data_size ) )
+                return std::nullopt;
+
+            out.m_data = out.m_copy.data( );
+            out.m_size = out.m_copy.size( );
+            return std::make_optional( std::move( out ) );
+        }
     };
 
     class vpk_file
@@ -171,61 +442,151 @@ namespace valve
     public:
         using file_map_t = std::unordered_map<std::string, vpk_entry_t, case_insensitive_hash, case_insensitive_equal>;
 
-        bool load( const fs::path& file )
+        // load_mode::map maps the directory file instead of reading it, preload bytes then point into the mapping
+        // which is shared between processes and only the pages of the tree are touched
+        bool load( const fs::path& file, load_mode mode = load_mode::read )
         {
-            std::ifstream in( file, std::ios::binary );
+            kv_stats::timer_t timer{ kv_stats::load };
 
-            if ( !in.good( ) )
-                return false;
+            m_files.clear( );
+            m_archives.reset( );
+            m_buffer.clear( );
+            m_mapping.close( );
 
-            size_t size = fs::file_size( file );
+            const u8* data = nullptr;
+            size_t size = 0;
 
-            vpk_header_v2_t header{};
+            if ( mode == load_mode::map )
+            {
+                if ( !m_mapping.open( file ) )
+                    return false;
 
-            in.read( ( char* )&header, sizeof( vpk_header_v2_t ) );
-            in.seekg( std::ios::beg );
+                data = m_mapping.data( );
+                size = m_mapping.size( );
+            }
+            else
+            {
+                std::ifstream in( file, std::ios::binary );
 
-            if ( header.Signature != 0x55aa1234 || header.Version != 2 )
+                if ( !in.good( ) )
+                    return false;
+
+                size = fs::file_size( file );
+
+                vpk_header_v2_t header{};
+
+                // Check the header before reading the whole file
+                in.read( ( char* )&header, sizeof( vpk_header_v2_t ) );
+                in.seekg( std::ios::beg );
+
+                if ( header.Signature != 0x55aa1234 || header.Version != 2 )
+                    return false;
+
+                m_buffer.resize( size );
+                in.read( ( char* )m_buffer.data( ), size );
+                in.close( );
+
+                data = m_buffer.data( );
+            }
+
+            if ( size < sizeof( vpk_header_v2_t ) )
                 return false;
 
-            m_pak_path = file.u8string( );
+            vpk_header_v2_t header{};
+            std::memcpy( &header, data, sizeof( vpk_header_v2_t ) );
 
-            m_buffer.resize( size );
-            in.read( ( char* )m_buffer.data( ), size );
-            in.close( );
+            if ( header.Signature != 0x55aa1234 || header.Version != 2 || header.TreeSize > size - sizeof( vpk_header_v2_t ) )
+                return false;
 
-            u8* tree_start = m_buffer.data( ) + sizeof( vpk_header_v2_t );
+            m_pak_path = file.u8string( );
+            m_archives = std::make_unique<vpk_archive_cache>( m_pak_path, data, u64{ sizeof( vpk_header_v2_t ) } + header.TreeSize );
+
+            // The tree is never written to, views are non const only because buffer_view<u8> is
+            u8* tree_start = const_cast< u8* >( data ) + sizeof( vpk_header_v2_t );
             u8* tree_end = tree_start + header.TreeSize;
 
+            usize archive_count = 0;
+
+            if ( !parse_tree( tree_start, tree_end, archive_count ) )
+            {
+                m_files.clear( );
+                m_archives.reset( );
+                return false;
+            }
+
+            m_archives->set_archive_count( archive_count );
+
+            kv_stats::add( kv_stats::bytes_scanned, header.TreeSize );
+            return true;
+        }
+
+        std::optional<const vpk_entry_t*> find( std::string_view file ) const
+        {
+            if ( auto result = m_files.find( file.data( ) ); result != m_files.end( ) )
+            {
+                kv_stats::lookup( true, nullptr );
+                return std::make_optional( &result->second );
+            }
+
+            kv_stats::lookup( false, nullptr );
+            return std::nullopt;
+        }
+
+    private:
+        // Names and entries are checked against tree_end, a truncated tree fails instead of reading past the file
+        bool parse_tree( u8* tree_start, u8* tree_end, usize& archive_count )
+        {
             for ( u8* i = tree_start; i < tree_end; )
             {
-                auto read_string = [ &i ]( ) -> std::string_view
+                bool truncated = false;
+
+                auto read_string = [ &i, &truncated, tree_end ]( ) -> std::string_view
                 {
-                    size_t length = std::strlen( reinterpret_cast< const char* >( i ) );
+                    const void* terminator = std::memchr( i, '\0', tree_end - i );
+
+                    if ( !terminator )
+                    {
+                        truncated = true;
+                        return {};
+                    }
+
+                    size_t length = static_cast< const u8* >( terminator ) - i;
                     auto str_v = std::string_view{ reinterpret_cast< const char* >( i ), length };
                     i += length + 1;
                     return str_v;
                 };
 
                 std::string_view file_ext = read_string( );
+                if ( truncated )
+                    return false;
                 if ( file_ext.empty( ) )
                     continue;
 
                 while ( true )
                 {
                     std::string_view file_path = read_string( );
+                    if ( truncated )
+                        return false;
                     if ( file_path.empty( ) )
                         break;
 
                     while ( true )
                     {
                         std::string_view file_name = read_string( );
+                        if ( truncated )
+                            return false;
                         if ( file_name.empty( ) )
                             break;
 
+                        if ( static_cast< size_t >( tree_end - i ) < sizeof( vpk_dir_entry_t ) )
+                            return false;
+
                         vpk_dir_entry_t* vpk_entry = reinterpret_cast< vpk_dir_entry_t* >( i );
                         i += sizeof( vpk_dir_entry_t );
 
+                        if ( static_cast< size_t >( tree_end - i ) < vpk_entry->PreloadBytes )
+                            return false;
+
                         std::string path;
                         path.reserve( file_path.size( ) + file_name.size( ) + file_ext.size( ) + 1 );
                         path += file_path;
@@ -234,18 +595,35 @@ namespace valve
                         path += '.';
                         path += file_ext;
 
+#ifdef KV_STATS
+                        usize buckets = m_files.bucket_count( );
+#endif
                         auto [it, success] = m_files.try_emplace( std::move( path ), vpk_entry_t{} );
-                        
+#ifdef KV_STATS
+                        kv_stats::add( kv_stats::rehashes, m_files.bucket_count( ) != buckets );
+#endif
+
                         if ( !success )
+                        {
+                            kv_stats::add( kv_stats::duplicates_dropped );
+                            i += vpk_entry->PreloadBytes;
                             continue;
+                        }
+
+                        kv_stats::add( kv_stats::nodes_created );
 
                         vpk_entry_t& map_entry       = it->second;
-                        map_entry.m_pak_path         = m_pak_path;
+                        map_entry.m_pak_path         = m_archives->pak_path( );
                         map_entry.m_filename         = it->first;
                         map_entry.m_archive_index    = vpk_entry->ArchiveIndex;
                         map_entry.m_data_offset      = vpk_entry->EntryOffset;
                         map_entry.m_data_size        = vpk_entry->EntryLength;
+                        map_entry.m_crc              = vpk_entry->CRC;
                         map_entry.m_preload_fullfile = vpk_entry->EntryLength == 0;
+                        map_entry.m_archives         = m_archives.get( );
+
+                        if ( !map_entry.m_preload_fullfile && vpk_entry->ArchiveIndex != vpk_archive_cache::dir_index )
+                            archive_count = std::max<usize>( archive_count, vpk_entry->ArchiveIndex + 1u );
 
                         if ( vpk_entry->PreloadBytes )
                         {
@@ -259,17 +637,11 @@ namespace valve
             return true;
         }
 
-        std::optional<const vpk_entry_t*> find( std::string_view file ) const
-        {
-            if ( auto result = m_files.find( file.data( ) ); result != m_files.end( ) )
-                return std::make_optional( &result->second );
-
-            return std::nullopt;
-        }
-
     public:
-        std::string     m_pak_path;
-        std::vector<u8> m_buffer;
-        file_map_t      m_files;
+        std::string                        m_pak_path;
+        std::vector<u8>                    m_buffer;       // Whole directory file, empty when loaded with load_mode::map
+        mapped_file                        m_mapping;
+        file_map_t                         m_files;
+        std::unique_ptr<vpk_archive_cache> m_archives;     // Entries point to it, on the heap so it doesn't move with the vpk_file
     };
 }
\ No newline at end of file
@@ -0,0 +1,282 @@
+#pragma once
+
+#include "vpk.hpp"
+#include "parallel.hpp"
+
+#include <vector>
+#include <string>
+#include <chrono>
+#include <fstream>
+#include <algorithm>
+#include <unordered_set>
+
+namespace valve
+{
+    struct vpk_extract_options
+    {
+        usize m_max_gap  = 64 * 1024;           // Entries at most this far apart in an archive are read together
+        usize m_max_read = 16 * 1024 * 1024;    // Largest read, bigger entries are read alone
+        u32   m_threads  = 0;                   // 0 means one per hardware thread
+    };
+
+    struct vpk_extract_stats
+    {
+        u64                      m_files{ 0 };
+        u64                      m_bytes{ 0 };          // Content of the files
+        u64                      m_reads{ 0 };          // Reads from archives after coalescing
+        u64                      m_read_bytes{ 0 };     // Gaps between entries included
+        f64                      m_seconds{ 0 };
+        std::vector<std::string> m_failed;              // Entries that couldn't be read or written
+
+        f64 bytes_per_second( ) const
+        {
+            return m_seconds > 0 ? m_bytes / m_seconds : 0;
+        }
+        f64 files_per_second( ) const
+        {
+            return m_seconds > 0 ? m_files / m_seconds : 0;
+        }
+    };
+
+    // Reads many entries of a vpk at once, entries are grouped by archive and sorted by offset so each archive is
+    // read front to back in a few large reads instead of one seek per file
+    class vpk_extractor
+    {
+        struct run_t
+        {
+            u32   m_archive_index;
+            u64   m_offset;
+            usize m_size;
+            usize m_first;      // Range in the sorted entries
+            usize m_last;
+        };
+
+    public:
+        vpk_extractor( const vpk_file& vpk, vpk_extract_options options = {} ) : m_vpk( vpk ), m_options( options ) {}
+
+        // Calls fn( entry, data ) for every entry filter( entry ) accepts, fn runs on the worker threads and
+        // returns false if it failed, data is only valid during the call
+        template <typename Filter, typename F>
+        vpk_extract_stats for_each( Filter&& filter, F&& fn ) const
+        {
+            auto start = std::chrono::steady_clock::now( );
+            vpk_extract_stats stats;
+
+            std::vector<const vpk_entry_t*> entries;
+
+            for ( const auto& [ path, entry ] : m_vpk.m_files )
+            {
+                if ( filter( entry ) )
+                    entries.push_back( &entry );
+            }
+
+            // Entries stored whole in the directory file go first, they need no reads
+            std::sort( entries.begin( ), entries.end( ), [ ]( const vpk_entry_t* a, const vpk_entry_t* b )
+            {
+                if ( a->m_preload_fullfile != b->m_preload_fullfile )
+                    return a->m_preload_fullfile;
+
+                if ( a->m_archive_index != b->m_archive_index )
+                    return a->m_archive_index < b->m_archive_index;
+
+                return a->m_data_offset < b->m_data_offset;
+            } );
+
+            std::vector<run_t> runs = coalesce( entries );
+            std::vector<std::vector<std::string>> failed( runs.size( ) );
+            std::atomic<u64> files{ 0 };
+            std::atomic<u64> bytes{ 0 };
+
+            parallel_for( runs.size( ), [ & ]( usize r )
+            {
+                const run_t& run = runs[ r ];
+                std::vector<u8> buffer( run.m_size );
+                std::vector<u8> joined;
+
+                // One bad entry at the end of an archive fails the whole run, read the entries one by one then
+                if ( run.m_size && !m_vpk.m_archives->read( run.m_archive_index, run.m_offset, buffer.data( ), run.m_size ) )
+                {
+                    for ( usize i = run.m_first; i < run.m_last; ++i )
+                    {
+                        auto data = entries[ i ]->get_data( );
+
+                        if ( !data || !fn( *entries[ i ], buffer_view<const u8>{ data->data( ), data->size( ) } ) )
+                        {
+                            failed[ r ].emplace_back( entries[ i ]->m_filename );
+                            continue;
+                        }
+
+                        files.fetch_add( 1, std::memory_order_relaxed );
+                        bytes.fetch_add( data->size( ), std::memory_order_relaxed );
+                    }
+                    return;
+                }
+
+                for ( usize i = run.m_first; i < run.m_last; ++i )
+                {
+                    const vpk_entry_t& entry = *entries[ i ];
+                    buffer_view<const u8> data{ entry.m_preload_bytes.data( ), entry.m_preload_bytes.size( ) };
+
+                    if ( !entry.m_preload_fullfile )
+                    {
+                        const u8* archive_data = buffer.data( ) + ( entry.m_data_offset - run.m_offset );
+
+                        if ( entry.m_preload_bytes.empty( ) )
+                            data = buffer_view<const u8>{ archive_data, entry.m_data_size };
+                        else
+                        {
+                            joined.assign( entry.m_preload_bytes.begin( ), entry.m_preload_bytes.end( ) );
+                            joined.insert( joined.end( ), archive_data, archive_data + entry.m_data_size );
+                            data = buffer_view<const u8>{ joined.data( ), joined.size( ) };
+                        }
+                    }
+
+                    if ( !fn( entry, data ) )
+                    {
+                        failed[ r ].emplace_back( entry.m_filename );
+                        continue;
+                    }
+
+                    files.fetch_add( 1, std::memory_order_relaxed );
+                    bytes.fetch_add( data.size( ), std::memory_order_relaxed );
+                }
+            }, m_options.m_threads );
+
+            for ( const run_t& run : runs )
+            {
+                stats.m_reads += run.m_size != 0;
+                stats.m_read_bytes += run.m_size;
+            }
+
+            for ( auto& run_failed : failed )
+                stats.m_failed.insert( stats.m_failed.end( ), run_failed.begin( ), run_failed.end( ) );
+
+            stats.m_files = files;
+            stats.m_bytes = bytes;
+            stats.m_seconds = std::chrono::duration<f64>( std::chrono::steady_clock::now( ) - start ).count( );
+            return stats;
+        }
+
+        // Writes every entry filter( entry ) accepts to out_dir / entry path
+        // Paths that are absolute or contain .. are not written and end up in m_failed
+        template <typename Filter>
+        vpk_extract_stats extract( const fs::path& out_dir, Filter&& filter ) const
+        {
+            auto start = std::chrono::steady_clock::now( );
+
+            // Directories are made up front, creating the same one from several threads races
+            std::unordered_set<const vpk_entry_t*> accepted;
+            std::unordered_set<std::string> dirs;
+            std::vector<std::string> unsafe;
+
+            for ( const auto& [ path, entry ] : m_vpk.m_files )
+            {
+                if ( !filter( entry ) )
+                    continue;
+
+                if ( !is_safe( path ) )
+                {
+                    unsafe.push_back( path );
+                    continue;
+                }
+
+                accepted.insert( &entry );
+
+                if ( usize slash = path.find_last_of( '/' ); slash != std::string::npos )
+                    dirs.emplace( path.substr( 0, slash ) );
+            }
+
+            for ( const std::string& dir : dirs )
+            {
+                std::error_code ec;
+                fs::create_directories( out_dir / fs::u8path( dir ), ec );
+            }
+
+            auto is_accepted = [ & ]( const vpk_entry_t& entry )
+            {
+                return accepted.count( &entry ) != 0;
+            };
+
+            vpk_extract_stats stats = for_each( is_accepted, [ & ]( const vpk_entry_t& entry, buffer_view<const u8> data )
+            {
+                std::ofstream out( out_dir / fs::u8path( entry.m_filename ), std::ios::binary );
+                return out.write( reinterpret_cast< const char* >( data.data( ) ), data.size( ) ).good( );
+            } );
+
+            stats.m_failed.insert( stats.m_failed.end( ), unsafe.begin( ), unsafe.end( ) );
+            stats.m_seconds = std::chrono::duration<f64>( std::chrono::steady_clock::now( ) - start ).count( );
+            return stats;
+        }
+        vpk_extract_stats extract( const fs::path& out_dir ) const
+        {
+            return extract( out_dir, [ ]( const vpk_entry_t& ) { return true; } );
+        }
+
+    private:
+        // Splits sorted entries into runs of entries close enough in one archive to read at once
+        std::vector<run_t> coalesce( const std::vector<const vpk_entry_t*>& entries ) const
+        {
+            std::vector<run_t> runs;
+
+            for ( usize i = 0; i < entries.size( ); ++i )
+            {
+                const vpk_entry_t& entry = *entries[ i ];
+
+                // Whole in the directory file, nothing to read
+                if ( entry.m_preload_fullfile )
+                {
+                    if ( runs.empty( ) || runs.back( ).m_size || runs.back( ).m_last - runs.back( ).m_first >= 256 )
+                        runs.push_back( run_t{ 0, 0, 0, i, i } );
+
+                    runs.back( ).m_last = i + 1;
+                    continue;
+                }
+
+                u64 begin = entry.m_data_offset;
+                u64 end = begin + entry.m_data_size;
+
+                if ( !runs.empty( ) && runs.back( ).m_size )
+                {
+                    run_t& run = runs.back( );
+                    u64 run_end = run.m_offset + run.m_size;
+
+                    if ( run.m_archive_index == entry.m_archive_index && begin <= run_end + m_options.m_max_gap && end - run.m_offset <= m_options.m_max_read )
+                    {
+                        run.m_size = static_cast< usize >( std::max( run_end, end ) - run.m_offset );
+                        run.m_last = i + 1;
+                        continue;
+                    }
+                }
+
+                runs.push_back( run_t{ entry.m_archive_index, begin, static_cast< usize >( entry.m_data_size ), i, i + 1 } );
+            }
+
+            return runs;
+        }
+
+        static bool is_safe( std::string_view path )
+        {
+            if ( path.empty( ) || path.front( ) == '/' || path.front( ) == '\\' || path.find( ':' ) != std::string_view::npos )
+                return false;
+
+            for ( usize start = 0; start <= path.size( ); )
+            {
+                usize end = path.find_first_of( "/\\", start );
+
+                if ( end == std::string_view::npos )
+                    end = path.size( );
+
+                if ( path.substr( start, end - start ) == ".." )
+                    return false;
+
+                start = end + 1;
+            }
+
+            return true;
+        }
+
+    private:
+        const vpk_file&     m_vpk;
+        vpk_extract_options m_options;
+    };
+}
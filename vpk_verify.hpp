@@ -0,0 +1,154 @@
+#pragma once
+
+#include "vpk_extract.hpp"
+#include "crc32.hpp"
+
+#include <mutex>
+
+namespace valve
+{
+    struct vpk_verify_options
+    {
+        usize m_stream_size = 4 * 1024 * 1024;  // Entries bigger than this are hashed in chunks of this size instead of read whole, 0 counts as 1
+        u32   m_threads     = 0;                // 0 means one per hardware thread
+    };
+
+    struct vpk_mismatch_t
+    {
+        std::string m_path;
+        u32         m_expected;
+        u32         m_actual;
+        bool        m_unreadable;   // Couldn't be read at all, m_actual is 0
+    };
+
+    struct vpk_verify_report
+    {
+        u64                         m_files{ 0 };
+        u64                         m_bytes{ 0 };
+        f64                         m_seconds{ 0 };
+        std::vector<vpk_mismatch_t> m_mismatches;   // Sorted by path
+
+        bool ok( ) const
+        {
+            return m_mismatches.empty( );
+        }
+    };
+
+    // Checks entries against the CRC stored in the directory, small entries go through vpk_extractor in archive
+    // order and big ones are streamed so nothing is ever held whole in memory
+    class vpk_verifier
+    {
+    public:
+        vpk_verifier( const vpk_file& vpk, vpk_verify_options options = {} ) : m_vpk( vpk ), m_options( options ) {}
+
+        template <typename Filter>
+        vpk_verify_report verify( Filter&& filter ) const
+        {
+            auto start = std::chrono::steady_clock::now( );
+            vpk_verify_report report;
+            std::mutex mutex;
+
+            auto mismatch = [ & ]( const vpk_entry_t& entry, u32 actual, bool unreadable )
+            {
+                std::lock_guard<std::mutex> lock( mutex );
+                report.m_mismatches.push_back( vpk_mismatch_t{ std::string{ entry.m_filename }, entry.m_crc, actual, unreadable } );
+            };
+
+            std::vector<const vpk_entry_t*> streamed;
+
+            // A chunk size of 0 would never advance
+            usize stream_size = std::max<usize>( m_options.m_stream_size, 1 );
+
+            for ( const auto& [ path, entry ] : m_vpk.m_files )
+            {
+                if ( !entry.m_preload_fullfile && entry.m_data_size > stream_size && filter( entry ) )
+                    streamed.push_back( &entry );
+            }
+
+            vpk_extract_options extract_options;
+            extract_options.m_max_read = stream_size;
+            extract_options.m_threads = m_options.m_threads;
+
+            auto small = [ & ]( const vpk_entry_t& entry )
+            {
+                return ( entry.m_preload_fullfile || entry.m_data_size <= stream_size ) && filter( entry );
+            };
+
+            vpk_extract_stats stats = vpk_extractor{ m_vpk, extract_options }.for_each( small, [ & ]( const vpk_entry_t& entry, buffer_view<const u8> data )
+            {
+                if ( u32 actual = crc32( data.data( ), data.size( ) ); actual != entry.m_crc )
+                    mismatch( entry, actual, false );
+
+                return true;
+            } );
+
+            for ( const std::string& path : stats.m_failed )
+            {
+                const vpk_entry_t& entry = m_vpk.m_files.find( path )->second;
+                report.m_mismatches.push_back( vpk_mismatch_t{ path, entry.m_crc, 0, true } );
+            }
+
+            report.m_files = stats.m_files;
+            report.m_bytes = stats.m_bytes;
+
+            // Archive order, parallel_for hands them out in order so neighbours are read close together in time
+            std::sort( streamed.begin( ), streamed.end( ), [ ]( const vpk_entry_t* a, const vpk_entry_t* b )
+            {
+                if ( a->m_archive_index != b->m_archive_index )
+                    return a->m_archive_index < b->m_archive_index;
+
+                return a->m_data_offset < b->m_data_offset;
+            } );
+
+            std::atomic<u64> streamed_files{ 0 };
+            std::atomic<u64> streamed_bytes{ 0 };
+
+            parallel_for( streamed.size( ), [ & ]( usize i )
+            {
+                const vpk_entry_t& entry = *streamed[ i ];
+                std::vector<u8> chunk( stream_size );
+
+                u32 actual = crc32( entry.m_preload_bytes.data( ), entry.m_preload_bytes.size( ) );
+
+                for ( u64 done = 0; done < entry.m_data_size; )
+                {
+                    usize size = static_cast< usize >( std::min<u64>( chunk.size( ), entry.m_data_size - done ) );
+
+                    if ( !m_vpk.m_archives->read( entry.m_archive_index, entry.m_data_offset + done, chunk.data( ), size ) )
+                    {
+                        mismatch( entry, 0, true );
+                        return;
+                    }
+
+                    actual = crc32( chunk.data( ), size, actual );
+                    done += size;
+                }
+
+                if ( actual != entry.m_crc )
+                    mismatch( entry, actual, false );
+
+                streamed_files.fetch_add( 1, std::memory_order_relaxed );
+                streamed_bytes.fetch_add( entry.m_preload_bytes.size( ) + entry.m_data_size, std::memory_order_relaxed );
+            }, m_options.m_threads );
+
+            report.m_files += streamed_files;
+            report.m_bytes += streamed_bytes;
+
+            std::sort( report.m_mismatches.begin( ), report.m_mismatches.end( ), [ ]( const vpk_mismatch_t& a, const vpk_mismatch_t& b )
+            {
+                return a.m_path < b.m_path;
+            } );
+
+            report.m_seconds = std::chrono::duration<f64>( std::chrono::steady_clock::now( ) - start ).count( );
+            return report;
+        }
+        vpk_verify_report verify( ) const
+        {
+            return verify( [ ]( const vpk_entry_t& ) { return true; } );
+        }
+
+    private:
+        const vpk_file&    m_vpk;
+        vpk_verify_options m_options;
+    };
+}